@@ -51,12 +51,26 @@ void printMissing(StoreAPI & store, const PathSet & paths)
 }
 
 
+static string showDuration(time_t t)
+{
+    if (t >= 3600) return (format("%1%h%2$02dm") % (t / 3600) % (t % 3600 / 60)).str();
+    if (t >= 60) return (format("%1%m%2$02ds") % (t / 60) % (t % 60)).str();
+    return (format("%1%s") % t).str();
+}
+
+
 void printMissing(const PathSet & willBuild,
     const PathSet & willSubstitute, const PathSet & unknown,
     unsigned long long downloadSize, unsigned long long narSize)
 {
     if (!willBuild.empty()) {
-        printMsg(lvlInfo, format("these derivations will be built:"));
+        unsigned int nrKnown;
+        time_t estimate = estimateBuildTime(*store, willBuild, nrKnown);
+        if (nrKnown == 0)
+            printMsg(lvlInfo, format("these derivations will be built:"));
+        else
+            printMsg(lvlInfo, format("these derivations will be built (about %1%, going by earlier builds of %2% of %3%):")
+                % showDuration(estimate) % nrKnown % willBuild.size());
         foreach (PathSet::iterator, i, willBuild)
             printMsg(lvlInfo, format("  %1%") % *i);
     }
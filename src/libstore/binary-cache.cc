@@ -0,0 +1,413 @@
+#include "config.h"
+
+#include "binary-cache.hh"
+#include "globals.hh"
+#include "archive.hh"
+#include "thread-pool.hh"
+#include "util.hh"
+
+#include <algorithm>
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <bzlib.h>
+
+
+namespace nix {
+
+
+static const string fileURLPrefix = "file://";
+
+
+/* The maximum number of threads reading `.narinfo' files.  This is
+   I/O bound, so there is no point in having one thread per core. */
+static const unsigned int narInfoThreads = 8;
+
+
+LocalBinaryCaches::LocalBinaryCaches()
+    : initialised(false)
+{
+}
+
+
+/* The priorities of other caches are only known to
+   download-from-binary-cache.pl, so a local cache could shadow a
+   remote one that has a better priority.  Therefore we only take
+   over if all the caches are local. */
+Strings LocalBinaryCaches::getURLs()
+{
+    Strings urls = settings.getBinaryCaches();
+    foreach (Strings::iterator, i, urls)
+        if (string(*i, 0, fileURLPrefix.size()) != fileURLPrefix)
+            return Strings();
+    return urls;
+}
+
+
+/* Split a `Key: value' line as used in `nix-cache-info' and
+   `.narinfo' files. */
+static bool splitLine(const string & line, string & key, string & value)
+{
+    string::size_type n = line.find(": ");
+    if (n == string::npos) return false;
+    key = string(line, 0, n);
+    value = string(line, n + 2);
+    return true;
+}
+
+
+void LocalBinaryCaches::init()
+{
+    if (initialised) return;
+    initialised = true;
+
+    Strings urls = getURLs();
+
+    foreach (Strings::iterator, i, urls) {
+        Cache cache;
+        cache.dir = string(*i, fileURLPrefix.size());
+        cache.wantMassQuery = false;
+        cache.priority = 50;
+
+        Path infoFile = cache.dir + "/nix-cache-info";
+        string contents;
+        try {
+            contents = readFile(infoFile);
+        } catch (SysError & e) {
+            printMsg(lvlError, format("could not read `%1%': %2%") % infoFile % e.msg());
+            continue;
+        }
+
+        Path storeDir = "/nix/store";
+        Strings lines = tokenizeString<Strings>(contents, "\n");
+        foreach (Strings::iterator, j, lines) {
+            string key, value;
+            if (!splitLine(*j, key, value))
+                throw Error(format("bad cache info file `%1%'") % infoFile);
+            if (key == "StoreDir") storeDir = value;
+            else if (key == "WantMassQuery") {
+                int n;
+                cache.wantMassQuery = string2Int(value, n) && n;
+            }
+            else if (key == "Priority") string2Int(value, cache.priority);
+        }
+
+        if (storeDir != settings.nixStore) continue;
+
+        caches.push_back(cache);
+    }
+
+    std::stable_sort(caches.begin(), caches.end());
+}
+
+
+/* The result of reading one `.narinfo' file. */
+struct NarInfoLookup
+{
+    Path storePath;
+    Path infoFile;
+    bool found;
+    NarInfo info;
+    string error;
+};
+
+
+/* Parse the info file of `lookup.storePath' in `lookup.info'.  As in
+   download-from-binary-cache.pl, malformed files are ignored. */
+static bool parseNarInfo(NarInfoLookup & lookup, const string & contents)
+{
+    NarInfo & info(lookup.info);
+    info.compression = "bzip2";
+    info.fileSize = info.narSize = 0;
+
+    Path storePath;
+    Strings lines = tokenizeString<Strings>(contents, "\n");
+    foreach (Strings::iterator, i, lines) {
+        string key, value;
+        if (!splitLine(*i, key, value)) return false;
+        if (key == "StorePath") storePath = value;
+        else if (key == "URL") info.url = value;
+        else if (key == "Compression") info.compression = value;
+        else if (key == "FileSize") string2Int(value, info.fileSize);
+        else if (key == "NarHash") info.narHash = value;
+        else if (key == "NarSize") string2Int(value, info.narSize);
+        else if (key == "References") {
+            Strings refs = tokenizeString<Strings>(value, " ");
+            foreach (Strings::iterator, j, refs)
+                info.references.insert(settings.nixStore + "/" + *j);
+        }
+        else if (key == "Deriver" && value != "")
+            info.deriver = settings.nixStore + "/" + value;
+    }
+
+    return storePath == lookup.storePath && info.url != "" && info.narHash != "";
+}
+
+
+/* Runs in a worker thread, so it records errors rather than printing
+   them. */
+static void readNarInfo(NarInfoLookup & lookup)
+{
+    lookup.found = false;
+
+    int fd = open(lookup.infoFile.c_str(), O_RDONLY);
+    if (fd == -1) {
+        if (errno != ENOENT)
+            lookup.error = (format("could not read `%1%': %2%") % lookup.infoFile % strerror(errno)).str();
+        return;
+    }
+
+    string contents;
+    try {
+        contents = readFile(fd);
+    } catch (SysError & e) {
+        lookup.error = (format("could not read `%1%': %2%") % lookup.infoFile % e.msg()).str();
+    }
+    close(fd);
+
+    if (lookup.error == "") lookup.found = parseNarInfo(lookup, contents);
+}
+
+
+struct ReadNarInfoWork : ThreadPool::Work
+{
+    NarInfoLookup & lookup;
+    ReadNarInfoWork(NarInfoLookup & lookup) : lookup(lookup) { }
+    void run() { readNarInfo(lookup); }
+};
+
+
+void LocalBinaryCaches::query(const PathSet & paths, bool massQuery)
+{
+    init();
+
+    PathSet left;
+    foreach (PathSet::const_iterator, i, paths)
+        if (infos.find(*i) == infos.end()) left.insert(*i);
+
+    foreach (std::vector<Cache>::iterator, i, caches) {
+        if (left.empty()) break;
+        if (massQuery && !i->wantMassQuery) continue;
+
+        std::vector<NarInfoLookup> lookups;
+        foreach (PathSet::iterator, j, left) {
+            if (i->missing.find(*j) != i->missing.end()) continue;
+            NarInfoLookup lookup;
+            lookup.storePath = *j;
+            lookup.infoFile = i->dir + "/" + string(baseNameOf(*j), 0, 32) + ".narinfo";
+            lookups.push_back(lookup);
+        }
+
+        /* Most lookups are for a single path, which isn't worth
+           starting threads for. */
+        if (lookups.size() > 1) {
+            ThreadPool pool(std::min((size_t) narInfoThreads, lookups.size()));
+            foreach (std::vector<NarInfoLookup>::iterator, j, lookups)
+                pool.enqueue(new ReadNarInfoWork(*j));
+            pool.process();
+        } else if (lookups.size() == 1)
+            readNarInfo(lookups[0]);
+
+        foreach (std::vector<NarInfoLookup>::iterator, j, lookups) {
+            if (j->error != "") printMsg(lvlError, j->error);
+            if (j->found) {
+                j->info.cacheDir = i->dir;
+                infos[j->storePath] = j->info;
+                left.erase(j->storePath);
+            } else
+                i->missing.insert(j->storePath);
+        }
+    }
+}
+
+
+PathSet LocalBinaryCaches::querySubstitutablePaths(const PathSet & paths)
+{
+    query(paths, true);
+
+    PathSet res;
+    foreach (PathSet::const_iterator, i, paths) {
+        NarInfos::iterator j = infos.find(*i);
+        if (j == infos.end()) continue;
+        /* The info may have come from a cache that doesn't allow mass
+           queries. */
+        foreach (std::vector<Cache>::iterator, k, caches)
+            if (k->dir == j->second.cacheDir) {
+                if (k->wantMassQuery) res.insert(*i);
+                break;
+            }
+    }
+    return res;
+}
+
+
+void LocalBinaryCaches::querySubstitutablePathInfos(PathSet & paths,
+    SubstitutablePathInfos & infos)
+{
+    query(paths, false);
+
+    PathSet todo(paths);
+    foreach (PathSet::iterator, i, todo) {
+        NarInfos::iterator j = this->infos.find(*i);
+        if (j == this->infos.end()) continue;
+        SubstitutablePathInfo & info(infos[*i]);
+        info.deriver = j->second.deriver;
+        info.references = j->second.references;
+        info.downloadSize = j->second.fileSize;
+        info.narSize = j->second.narSize;
+        paths.erase(*i);
+    }
+}
+
+
+/* A source that decompresses bzip2 data from another source.  Like
+   bunzip2, it decodes concatenated streams (as written by parallel
+   compressors such as pbzip2) one after the other. */
+struct BzipSource : BufferedSource
+{
+    Source & from;
+    bz_stream strm;
+    unsigned char in[65536];
+    bool finished;
+
+    BzipSource(Source & from) : from(from), finished(false)
+    {
+        memset(&strm, 0, sizeof(strm));
+        init();
+    }
+
+    ~BzipSource()
+    {
+        BZ2_bzDecompressEnd(&strm);
+    }
+
+    void init()
+    {
+        if (BZ2_bzDecompressInit(&strm, 0, 0) != BZ_OK)
+            throw Error("unable to initialise bzip2 decoder");
+    }
+
+    /* Fill the input buffer if it is empty.  Return false at the end
+       of the underlying source. */
+    bool fill()
+    {
+        if (strm.avail_in != 0) return true;
+        try {
+            strm.avail_in = from.read(in, sizeof(in));
+        } catch (EndOfFile &) {
+            return false;
+        }
+        strm.next_in = (char *) in;
+        return true;
+    }
+
+    size_t readUnbuffered(unsigned char * data, size_t len)
+    {
+        if (finished) throw EndOfFile("unexpected end of bzip2 stream");
+
+        strm.next_out = (char *) data;
+        strm.avail_out = len;
+
+        while (strm.avail_out == len) {
+            if (!fill()) throw EndOfFile("unexpected end of bzip2 stream");
+            int ret = BZ2_bzDecompress(&strm);
+            if (ret == BZ_STREAM_END) {
+                /* Another stream may follow.  The decoder can't be
+                   reused, so start a new one, keeping the input that
+                   it hasn't consumed yet. */
+                if (!fill()) { finished = true; break; }
+                bz_stream old = strm;
+                BZ2_bzDecompressEnd(&strm);
+                memset(&strm, 0, sizeof(strm));
+                init();
+                strm.next_in = old.next_in;
+                strm.avail_in = old.avail_in;
+                strm.next_out = old.next_out;
+                strm.avail_out = old.avail_out;
+                continue;
+            }
+            if (ret != BZ_OK) throw Error("error decompressing bzip2 data");
+        }
+
+        size_t n = len - strm.avail_out;
+        if (n == 0) throw EndOfFile("unexpected end of bzip2 stream");
+        return n;
+    }
+};
+
+
+string LocalBinaryCaches::substitute(const Path & storePath, const Path & destPath)
+{
+    query(singleton<PathSet>(storePath), false);
+
+    NarInfos::iterator i = infos.find(storePath);
+    if (i == infos.end())
+        throw Error(format("path `%1%' is not in any binary cache") % storePath);
+    const NarInfo & info(i->second);
+
+    Path narFile = info.cacheDir + "/" + info.url;
+
+    printMsg(lvlError, format("unpacking `%1%' to `%2%'...") % narFile % storePath);
+
+    AutoCloseFD fd = open(narFile.c_str(), O_RDONLY);
+    if (fd == -1) throw SysError(format("opening `%1%'") % narFile);
+
+    if (info.compression == "none") {
+        FdSource source(fd);
+        restorePath(destPath, source);
+    }
+
+    else if (info.compression == "bzip2") {
+        FdSource compressed(fd);
+        BzipSource source(compressed);
+        restorePath(destPath, source);
+    }
+
+    /* There is no liblzma dependency, so pipe the NAR through xz. */
+    else if (info.compression == "xz") {
+        Pipe pipe;
+        pipe.create();
+
+        Pid pid;
+        pid = fork();
+
+        switch (pid) {
+
+        case -1:
+            throw SysError("unable to fork");
+
+        case 0: /* child */
+            try {
+                if (dup2(fd, STDIN_FILENO) == -1)
+                    throw SysError("dupping stdin");
+                if (dup2(pipe.writeSide, STDOUT_FILENO) == -1)
+                    throw SysError("dupping stdout");
+                execl(XZ_PATH, XZ_PATH, "-d", NULL);
+                throw SysError(format("executing `%1%'") % XZ_PATH);
+            } catch (std::exception & e) {
+                writeToStderr("error: " + string(e.what()) + "\n");
+            }
+            _exit(1);
+        }
+
+        pipe.writeSide.close();
+
+        FdSource source(pipe.readSide);
+        restorePath(destPath, source);
+
+        pipe.readSide.close();
+        int status = pid.wait(true);
+        if (!statusOk(status))
+            throw Error(format("decompressing `%1%': xz %2%") % narFile % statusToString(status));
+    }
+
+    else
+        throw Error(format("unknown compression method `%1%' in binary cache") % info.compression);
+
+    return info.narHash;
+}
+
+
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include "types.hh"
+#include "store-api.hh"
+
+
+namespace nix {
+
+
+/* The contents of a `.narinfo' file in a binary cache. */
+struct NarInfo
+{
+    /* The directory of the cache that has the path. */
+    Path cacheDir;
+
+    /* The compressed NAR, relative to `cacheDir'. */
+    string url;
+
+    /* `xz', `bzip2' or `none'. */
+    string compression;
+
+    /* `<type>:<hash>' of the uncompressed NAR. */
+    string narHash;
+
+    unsigned long long fileSize, narSize;
+    PathSet references;
+    Path deriver;
+};
+
+
+/* The substituter built into Nix (`builtinBinaryCache').  It reads
+   the binary caches that are local directories (`file://' URLs)
+   directly, rather than through download-from-binary-cache.pl.  The
+   info files of many paths are read in parallel, and they are kept
+   in memory for the lifetime of the process. */
+class LocalBinaryCaches
+{
+public:
+    LocalBinaryCaches();
+
+    /* Return the URLs of the binary caches handled here: all of them
+       if they are all local directories, and none otherwise. */
+    Strings getURLs();
+
+    /* Return the paths in `paths' that are in a cache that allows
+       mass queries (`WantMassQuery: 1' in its `nix-cache-info'). */
+    PathSet querySubstitutablePaths(const PathSet & paths);
+
+    /* Fill in `infos' for the paths in `paths' that are in some
+       cache, and remove them from `paths'. */
+    void querySubstitutablePathInfos(PathSet & paths,
+        SubstitutablePathInfos & infos);
+
+    /* Unpack `storePath' from the first cache that has it into
+       `destPath'.  Return the expected NAR hash as `<type>:<hash>'. */
+    string substitute(const Path & storePath, const Path & destPath);
+
+private:
+
+    struct Cache
+    {
+        Path dir;
+        bool wantMassQuery;
+        int priority;
+        /* Paths known not to be in this cache. */
+        PathSet missing;
+        bool operator < (const Cache & c) const
+        {
+            return priority < c.priority;
+        }
+    };
+
+    bool initialised;
+    std::vector<Cache> caches;
+
+    typedef std::map<Path, NarInfo> NarInfos;
+    NarInfos infos;
+
+    void init();
+
+    /* Read the info files of those `paths' that we don't know about
+       yet, trying the caches in order of priority. */
+    void query(const PathSet & paths, bool massQuery);
+};
+
+
+}
@@ -8,6 +8,7 @@
 #include "util.hh"
 #include "archive.hh"
 #include "immutable.hh"
+#include "thread-pool.hh"
 
 #include <map>
 #include <sstream>
@@ -26,6 +27,7 @@
 #include <errno.h>
 #include <stdio.h>
 #include <cstring>
+#include <climits>
 
 #include <pwd.h>
 #include <grp.h>
@@ -44,6 +46,10 @@
 #include <sched.h>
 #endif
 
+#if HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
 #define CHROOT_ENABLED HAVE_CHROOT && HAVE_UNSHARE && HAVE_SYS_MOUNT_H && defined(MS_BIND) && defined(MS_PRIVATE) && defined(CLONE_NEWNS)
 
 #if CHROOT_ENABLED
@@ -160,6 +166,28 @@ public:
         return exitCode;
     }
 
+    /* Return how long this goal is expected to take, in seconds.
+       Goals that nothing is known about count as taking 1 second, so
+       that without build history the goals are ordered by the number
+       of goals waiting for them. */
+    virtual time_t getExpectedDuration()
+    {
+        return 1;
+    }
+
+    /* Return the expected duration of the longest chain of goals
+       waiting for this one (including itself).  The goals at the
+       start of long chains are on the critical path of the build, so
+       they should get build slots first.  `criticalPaths' caches the
+       result for each goal. */
+    time_t getCriticalPath(map<Goal *, time_t> & criticalPaths);
+
+    /* Return the number of goals waiting directly for this one. */
+    unsigned int getNrWaiters()
+    {
+        return waiters.size();
+    }
+
     /* Cancel the goal.  It should wake up its waiters, get rid of any
        running child processes that are being monitored by the worker
        (important!), etc. */
@@ -179,11 +207,137 @@ struct Child
     set<int> fds;
     bool monitorForSilence;
     bool inBuildSlot;
+    bool inSubstitutionSlot;
     time_t lastOutput; /* time we last got output on stdout/stderr */
+    size_t readSize; /* how much to read at a time */
 };
 
 typedef map<pid_t, Child> Children;
 
+/* The child that each file descriptor of a child belongs to. */
+typedef map<int, pid_t> ChildFds;
+
+
+/* The order in which goals get build slots (and, more generally, get
+   to run).  Goals on the critical path go first: the longer the chain
+   of goals waiting for a goal is expected to take, the sooner it
+   should start.  Among goals with equally long chains, those that
+   more goals are waiting for go first. */
+struct GoalPriority
+{
+    WeakGoalPtr goal;
+    time_t criticalPath;
+    unsigned int nrWaiters;
+    bool operator < (const GoalPriority & p) const
+    {
+        return criticalPath > p.criticalPath ||
+            (criticalPath == p.criticalPath && nrWaiters > p.nrWaiters);
+    }
+};
+
+
+/* A GNU Make jobserver for a builder: a pipe holding one byte (a
+   token) for every job that the builder may run in addition to the
+   one it runs anyway.  Each build gets its own, so that builders
+   can't interfere with each other; the worker divides the idle cores
+   between them, and adjusts their tokens as builds start and finish.
+   Tokens can't be taken away from a Make that holds one, so if there
+   are too many, they are taken out of the pipe as they are
+   returned. */
+class Jobserver
+{
+    /* The pipe, opened for reading and writing.  This is what the
+       builders get. */
+    AutoCloseFD fd;
+
+    /* A non-blocking descriptor for the same pipe, so that we can
+       take tokens without waiting for them, and without making the
+       builders' descriptor non-blocking. */
+    AutoCloseFD fdNonBlocking;
+
+    /* The number of tokens in the pipe or held by builders. */
+    unsigned int tokens;
+
+    /* The number of tokens to take out of the pipe when they are
+       returned. */
+    unsigned int excess;
+
+public:
+    Jobserver() : tokens(0), excess(0) { }
+
+    void create();
+
+    int getFd()
+    {
+        return fd;
+    }
+
+    /* Adjust the number of tokens to `target'. */
+    void setTokens(unsigned int target);
+
+    /* Take back excess tokens that have been returned. */
+    void reclaim();
+};
+
+
+void Jobserver::create()
+{
+    /* A FIFO rather than a pipe, since it can be opened twice. */
+    Path dir = createTempDir("", "nix-jobserver", true, true, 0700);
+    Path fifo = dir + "/fifo";
+    if (mkfifo(fifo.c_str(), 0600) == -1)
+        throw SysError(format("creating FIFO `%1%'") % fifo);
+    fd = open(fifo.c_str(), O_RDWR);
+    if (fd == -1) throw SysError(format("opening `%1%'") % fifo);
+    fdNonBlocking = open(fifo.c_str(), O_RDONLY | O_NONBLOCK);
+    if (fdNonBlocking == -1) throw SysError(format("opening `%1%'") % fifo);
+    closeOnExec(fd);
+    closeOnExec(fdNonBlocking);
+    deletePath(dir);
+}
+
+
+void Jobserver::setTokens(unsigned int target)
+{
+    if (fd == -1) return;
+
+    unsigned int effective = tokens - excess;
+
+    if (target < effective) {
+        excess += effective - target;
+        reclaim();
+        return;
+    }
+
+    unsigned int more = target - effective;
+    unsigned int cancelled = std::min(more, excess);
+    excess -= cancelled;
+    more -= cancelled;
+
+    if (more) {
+        writeFull(fd, (const unsigned char *) string(more, '+').data(), more);
+        tokens += more;
+    }
+}
+
+
+void Jobserver::reclaim()
+{
+    if (fd == -1) return;
+    while (excess) {
+        unsigned char buf[256];
+        ssize_t rd = read(fdNonBlocking, buf, std::min(excess, (unsigned int) sizeof(buf)));
+        if (rd == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) break;
+            throw SysError("reading from the jobserver");
+        }
+        if (rd == 0) break;
+        tokens -= rd;
+        excess -= rd;
+    }
+}
+
 
 /* The worker class. */
 class Worker
@@ -202,13 +356,59 @@ private:
     /* Goals waiting for a build slot. */
     WeakGoals wantingToBuild;
 
+    /* Goals waiting for a substitution slot (if substitutions have
+       their own slots). */
+    WeakGoals wantingToSubstitute;
+
+    /* Whether the goals in `wantingToBuild' and `wantingToSubstitute'
+       should be woken up once the awake goals have run, because a
+       slot has become free. */
+    bool slotAvailable;
+
+    bool hasPriority(GoalPtr goal, const WeakGoals & waiting);
+
+    /* Cache for Goal::getCriticalPath(), cleared whenever the awake
+       goals get to run. */
+    map<Goal *, time_t> criticalPaths;
+
+    GoalPriority getPriority(GoalPtr goal);
+
     /* Child processes currently running. */
     Children children;
 
+    /* The file descriptors of the children in `children'. */
+    ChildFds childFds;
+
+#if HAVE_SYS_EPOLL_H
+    /* An epoll instance watching the file descriptors in
+       `childFds'. */
+    AutoCloseFD epollFd;
+    vector<struct epoll_event> events;
+#endif
+
+    /* The children monitored for silence, ordered by the time they
+       last produced output. */
+    set<std::pair<time_t, pid_t> > silentChildren;
+
+    /* Buffer for reading output from children. */
+    vector<unsigned char> readBuffer;
+
+    /* Give the builders the cores that the running builds don't use
+       by themselves. */
+    void updateJobservers();
+
+    void watchFd(int fd, pid_t pid);
+    void unwatchFd(int fd);
+    void handleChildInput(int fd, time_t now);
+
     /* Number of build slots occupied.  This includes local builds and
-       substitutions but not remote builds via the build hook. */
+       (unless they have their own slots) substitutions but not remote
+       builds via the build hook. */
     unsigned int nrLocalBuilds;
 
+    /* Number of substitution slots occupied. */
+    unsigned int nrSubstitutions;
+
     /* Maps used to prevent multiple instantiations of a goal for the
        same derivation / path. */
     WeakGoalMap derivationGoals;
@@ -226,6 +426,22 @@ private:
     /* Last time `waitForInput' was last called.  */
     time_t lastWait;
 
+    /* Statistics about the use of build slots: when run() started,
+       when the number of occupied slots last changed, the total time
+       that slots were occupied (in slot-seconds), the number of jobs
+       that ran in a slot, and the maximum number of slots occupied at
+       the same time. */
+    double runStart, lastSlotChange, busySlotTime;
+    unsigned int nrSlotJobs, maxLocalBuilds;
+
+    void updateSlotStats();
+    void printSlotStats();
+
+    /* The jobservers of the running builds, if `build-dynamic-cores'
+       is set. */
+    typedef set<Jobserver *> Jobservers;
+    Jobservers jobservers;
+
 public:
 
     /* Set if at least one derivation had a BuildError (i.e. permanent
@@ -250,14 +466,33 @@ public:
     void wakeUp(GoalPtr goal);
 
     /* Return the number of local build and substitution processes
-       currently running (but not remote builds via the build
-       hook). */
+       currently running (but not remote builds via the build hook,
+       nor substitutions in substitution slots). */
     unsigned int getNrLocalBuilds();
 
+    /* Return the number of substitutions running in substitution
+       slots. */
+    unsigned int getNrSubstitutions()
+    {
+        return nrSubstitutions;
+    }
+
+    /* Return the number of cores that a build that is about to start
+       should use (NIX_BUILD_CORES). */
+    unsigned int getBuildCores();
+
+    /* Give a share of the idle cores to the jobserver of a build
+       that has started, and stop doing so when it is finished. */
+    void addJobserver(Jobserver & jobserver);
+    void removeJobserver(Jobserver & jobserver);
+
     /* Registers a running child process.  `inBuildSlot' means that
-       the process counts towards the jobs limit. */
+       the process counts towards the jobs limit, and
+       `inSubstitutionSlot' that it counts towards the substitution
+       jobs limit. */
     void childStarted(GoalPtr goal, pid_t pid,
-        const set<int> & fds, bool inBuildSlot, bool monitorForSilence);
+        const set<int> & fds, bool inBuildSlot, bool monitorForSilence,
+        bool inSubstitutionSlot = false);
 
     /* Unregisters a running child process.  `wakeSleepers' should be
        false if there is no sense in waking up goals that are sleeping
@@ -269,6 +504,15 @@ public:
        might be right away). */
     void waitForBuildSlot(GoalPtr goal);
 
+    /* Return false if a goal waiting for a build slot should get the
+       next free one before `goal'.  In that case, `goal' should call
+       waitForBuildSlot(). */
+    bool mayTakeBuildSlot(GoalPtr goal);
+
+    /* Likewise for substitution slots. */
+    void waitForSubstitutionSlot(GoalPtr goal);
+    bool mayTakeSubstitutionSlot(GoalPtr goal);
+
     /* Wait for any goal to finish.  Pretty indiscriminate way to
        wait for some resource that some other goal is holding. */
     void waitForAnyGoal(GoalPtr goal);
@@ -344,6 +588,21 @@ void Goal::amDone(ExitCode result)
 }
 
 
+time_t Goal::getCriticalPath(map<Goal *, time_t> & criticalPaths)
+{
+    map<Goal *, time_t>::iterator i = criticalPaths.find(this);
+    if (i != criticalPaths.end()) return i->second;
+
+    time_t downstream = 0;
+    foreach (WeakGoals::iterator, j, waiters) {
+        GoalPtr goal = j->lock();
+        if (goal) downstream = std::max(downstream, goal->getCriticalPath(criticalPaths));
+    }
+
+    return criticalPaths[this] = downstream + getExpectedDuration();
+}
+
+
 void Goal::trace(const format & f)
 {
     debug(format("%1%: %2%") % name % f);
@@ -815,6 +1074,21 @@ private:
     /* Whether this is a fixed-output derivation. */
     bool fixedOutput;
 
+    /* How long the last local build of this derivation took (see
+       LocalStore::queryBuildTime()), or 0 if unknown. */
+    time_t lastDuration;
+
+    /* When the builder was started. */
+    time_t buildStart;
+
+    /* The value of NIX_BUILD_CORES given to the builder. */
+    unsigned int buildCores;
+
+    /* The jobserver of the builder, if `build-dynamic-cores' is
+       set, and its file descriptor (or -1). */
+    std::auto_ptr<Jobserver> jobserver;
+    int jobserverFd;
+
     typedef void (DerivationGoal::*GoalState)();
     GoalState state;
 
@@ -850,6 +1124,11 @@ public:
         return drvPath;
     }
 
+    time_t getExpectedDuration()
+    {
+        return std::max(lastDuration, (time_t) 1);
+    }
+
     /* Add wanted outputs to an already existing derivation goal. */
     void addWantedOutputs(const StringSet & outputs);
 
@@ -901,6 +1180,10 @@ private:
     /* Forcibly kill the child process, if any. */
     void killChild();
 
+    /* Stop giving tokens to the jobserver of the builder, and close
+       it. */
+    void releaseJobserver();
+
     Path addHashRewrite(const Path & path);
 
     void repairClosure();
@@ -914,6 +1197,7 @@ DerivationGoal::DerivationGoal(const Path & drvPath, const StringSet & wantedOut
     , fLogFile(0)
     , bzLogFile(0)
     , useChroot(false)
+    , lastDuration(0)
     , repair(repair)
 {
     this->drvPath = drvPath;
@@ -937,9 +1221,18 @@ DerivationGoal::~DerivationGoal()
 }
 
 
+void DerivationGoal::releaseJobserver()
+{
+    if (!jobserver.get()) return;
+    worker.removeJobserver(*jobserver);
+    jobserver.reset();
+}
+
+
 void DerivationGoal::killChild()
 {
     if (pid != -1) {
+        releaseJobserver();
         worker.childTerminated(pid);
 
         if (buildUser.enabled()) {
@@ -1032,6 +1325,10 @@ void DerivationGoal::haveDerivation()
     /* Get the derivation. */
     drv = derivationFromPath(worker.store, drvPath);
 
+    BuildTime lastBuild;
+    if (worker.store.queryBuildTime(drvPath, drv, lastBuild))
+        lastDuration = lastBuild.duration;
+
     foreach (DerivationOutputs::iterator, i, drv.outputs)
         worker.store.addTempRoot(i->second.path);
 
@@ -1112,9 +1409,10 @@ void DerivationGoal::repairClosure()
        that produced those outputs. */
 
     /* Get the output closure. */
-    PathSet outputClosure;
+    PathSet outputs, outputClosure;
     foreach (DerivationOutputs::iterator, i, drv.outputs)
-        computeFSClosure(worker.store, i->second.path, outputClosure);
+        outputs.insert(i->second.path);
+    computeFSClosure(worker.store, outputs, outputClosure);
 
     /* Filter out our own outputs (which we have already checked). */
     foreach (DerivationOutputs::iterator, i, drv.outputs)
@@ -1185,7 +1483,9 @@ void DerivationGoal::inputsRealised()
         allPaths.insert(i->second.path);
     }
 
-    /* Determine the full set of input paths. */
+    /* Determine the full set of input paths, which is the closure of
+       the following. */
+    PathSet inputRoots;
 
     /* First, the input derivations. */
     foreach (DerivationInputs::iterator, i, drv.inputDrvs) {
@@ -1196,7 +1496,7 @@ void DerivationGoal::inputsRealised()
         Derivation inDrv = derivationFromPath(worker.store, i->first);
         foreach (StringSet::iterator, j, i->second)
             if (inDrv.outputs.find(*j) != inDrv.outputs.end())
-                computeFSClosure(worker.store, inDrv.outputs[*j].path, inputPaths);
+                inputRoots.insert(inDrv.outputs[*j].path);
             else
                 throw Error(
                     format("derivation `%1%' requires non-existent output `%2%' from input derivation `%3%'")
@@ -1204,8 +1504,9 @@ void DerivationGoal::inputsRealised()
     }
 
     /* Second, the input sources. */
-    foreach (PathSet::iterator, i, drv.inputSrcs)
-        computeFSClosure(worker.store, *i, inputPaths);
+    inputRoots.insert(drv.inputSrcs.begin(), drv.inputSrcs.end());
+
+    computeFSClosure(worker.store, inputRoots, inputPaths);
 
     debug(format("added input paths %1%") % showPaths(inputPaths));
 
@@ -1331,7 +1632,8 @@ void DerivationGoal::tryToBuild()
        derivation prefers to be done locally, do it even if
        maxBuildJobs is 0. */
     unsigned int curBuilds = worker.getNrLocalBuilds();
-    if (curBuilds >= settings.maxBuildJobs && !(preferLocalBuild && curBuilds == 0)) {
+    if ((curBuilds >= settings.maxBuildJobs && !(preferLocalBuild && curBuilds == 0))
+        || !worker.mayTakeBuildSlot(shared_from_this())) {
         worker.waitForBuildSlot(shared_from_this());
         outputLocks.unlock();
         return;
@@ -1340,6 +1642,7 @@ void DerivationGoal::tryToBuild()
     try {
 
         /* Okay, we have to build. */
+        buildStart = time(0);
         startBuilder();
 
     } catch (BuildError & e) {
@@ -1401,6 +1704,7 @@ void DerivationGoal::buildDone()
     debug(format("builder process for `%1%' finished") % drvPath);
 
     /* So the child is gone now. */
+    releaseJobserver();
     worker.childTerminated(savedPid);
 
     /* Close the read side of the logger pipe. */
@@ -1509,6 +1813,25 @@ void DerivationGoal::buildDone()
         outputLocks.setDeletion(true);
         outputLocks.unlock();
 
+        /* Remember how long the build took, to schedule and estimate
+           later builds.  Builds done through the hook happened on
+           another machine, so they don't tell us much.  This is just
+           bookkeeping, so don't fail the build if it goes wrong
+           (e.g. because the database is read-only or full). */
+        if (!hook) {
+            try {
+                BuildTime time;
+                time.duration = ::time(0) - buildStart;
+                foreach (DerivationOutputs::iterator, i, drv.outputs)
+                    time.outputSize += worker.store.queryPathInfo(i->second.path).narSize;
+                time.buildCores = buildCores;
+                worker.store.registerBuildTime(drvPath, drv, time);
+            } catch (Error & e) {
+                printMsg(lvlError, format("warning: could not record the build time of `%1%': %2%")
+                    % drvPath % e.msg());
+            }
+        }
+
     } catch (BuildError & e) {
         printMsg(lvlError, e.msg());
         outputLocks.unlock();
@@ -1687,7 +2010,22 @@ void DerivationGoal::startBuilder()
     env["NIX_STORE"] = settings.nixStore;
 
     /* The maximum number of cores to utilize for parallel building. */
-    env["NIX_BUILD_CORES"] = (format("%d") % settings.buildCores).str();
+    buildCores = worker.getBuildCores();
+    env["NIX_BUILD_CORES"] = (format("%d") % buildCores).str();
+
+    /* Give the builder a jobserver, so that it can use cores that
+       other builds leave idle.  This isn't passed to Make through
+       MAKEFLAGS, since that would make every build parallel,
+       including those that aren't parallel-safe; the builder has to
+       opt in (e.g. by passing `-j --jobserver-fds=$NIX_JOBSERVER_FDS'
+       to Make if parallel building is enabled). */
+    jobserverFd = -1;
+    if (settings.dynamicBuildCores) {
+        jobserver.reset(new Jobserver);
+        jobserver->create();
+        jobserverFd = jobserver->getFd();
+        env["NIX_JOBSERVER_FDS"] = (format("%1%,%1%") % jobserverFd).str();
+    }
 
     /* Add all bindings specified in the derivation. */
     foreach (StringPairs::iterator, i, drv.env)
@@ -1759,18 +2097,19 @@ void DerivationGoal::startBuilder()
            outputs as well.  This is useful if you want to do things
            like passing all build-time dependencies of some path to a
            derivation that builds a NixOS DVD image. */
-        PathSet paths, paths2;
+        PathSet paths, outputs;
         computeFSClosure(worker.store, storePath, paths);
-        paths2 = paths;
 
-        foreach (PathSet::iterator, j, paths2) {
+        foreach (PathSet::iterator, j, paths) {
             if (isDerivation(*j)) {
                 Derivation drv = derivationFromPath(worker.store, *j);
                 foreach (DerivationOutputs::iterator, k, drv.outputs)
-                    computeFSClosure(worker.store, k->second.path, paths);
+                    outputs.insert(k->second.path);
             }
         }
 
+        computeFSClosure(worker.store, outputs, paths);
+
         /* Write closure info to `fileName'. */
         writeFile(tmpDir + "/" + fileName,
             worker.store.makeValidityRegistration(paths, false, false));
@@ -2006,6 +2345,7 @@ void DerivationGoal::startBuilder()
     builderOut.writeSide.close();
     worker.childStarted(shared_from_this(), pid,
         singleton<set<int> >(builderOut.readSide), true, true);
+    if (jobserver.get()) worker.addJobserver(*jobserver);
 
     if (settings.printBuildTrace) {
         printMsg(lvlError, format("@ build-started %1% %2% %3% %4%")
@@ -2099,8 +2439,14 @@ void DerivationGoal::initChild()
         if (chdir(tmpDir.c_str()) == -1)
             throw SysError(format("changing into `%1%'") % tmpDir);
 
-        /* Close all other file descriptors. */
-        closeMostFDs(set<int>());
+        /* Close all other file descriptors, except the jobserver. */
+        set<int> keepFDs;
+        if (jobserverFd != -1) {
+            keepFDs.insert(jobserverFd);
+            if (fcntl(jobserverFd, F_SETFD, 0) == -1)
+                throw SysError("passing the jobserver to the builder");
+        }
+        closeMostFDs(keepFDs);
 
 #ifdef CAN_DO_LINUX32_BUILDS
         /* Change the personality to 32-bit if we're doing an
@@ -2273,7 +2619,8 @@ void DerivationGoal::computeClosure()
            time.  The hash is stored in the database so that we can
            verify later on whether nobody has messed with the store. */
         HashResult hash;
-        PathSet references = scanForReferences(path, allPaths, hash);
+        FileHashSink fileHashes(settings.autoOptimiseStore);
+        PathSet references = scanForReferences(path, allPaths, hash, fileHashes);
         contentHashes[path] = hash;
 
         /* For debugging, print out the referenced and unreferenced
@@ -2299,7 +2646,7 @@ void DerivationGoal::computeClosure()
                     throw BuildError(format("output is not allowed to refer to path `%1%'") % *i);
         }
 
-        worker.store.optimisePath(path); // FIXME: combine with scanForReferences()
+        worker.store.optimisePath(path, fileHashes);
 
         worker.store.markContentsGood(path);
     }
@@ -2655,11 +3002,20 @@ void SubstitutionGoal::tryToRun()
 {
     trace("trying to run");
 
-    /* Make sure that we are allowed to start a build.  Note that even
-       is maxBuildJobs == 0 (no local builds allowed), we still allow
-       a substituter to run.  This is because substitutions cannot be
-       distributed to another machine via the build hook. */
-    if (worker.getNrLocalBuilds() >= (settings.maxBuildJobs == 0 ? 1 : settings.maxBuildJobs)) {
+    /* Make sure that we are allowed to start a substitution.  If
+       substitutions have their own slots, they don't take build
+       slots.  Otherwise, note that even is maxBuildJobs == 0 (no
+       local builds allowed), we still allow a substituter to run.
+       This is because substitutions cannot be distributed to another
+       machine via the build hook. */
+    if (settings.maxSubstitutionJobs != 0) {
+        if (worker.getNrSubstitutions() >= settings.maxSubstitutionJobs
+            || !worker.mayTakeSubstitutionSlot(shared_from_this())) {
+            worker.waitForSubstitutionSlot(shared_from_this());
+            return;
+        }
+    } else if (worker.getNrLocalBuilds() >= (settings.maxBuildJobs == 0 ? 1 : settings.maxBuildJobs)
+        || !worker.mayTakeBuildSlot(shared_from_this())) {
         worker.waitForBuildSlot(shared_from_this());
         return;
     }
@@ -2703,38 +3059,72 @@ void SubstitutionGoal::tryToRun()
 
     worker.store.setSubstituterEnv();
 
-    /* Fill in the arguments. */
-    Strings args;
-    args.push_back(baseNameOf(sub));
-    args.push_back("--substitute");
-    args.push_back(storePath);
-    args.push_back(destPath);
-    const char * * argArr = strings2CharPtrs(args);
+    /* The builtin substituter runs in a child process too, so that
+       the worker can attend to other goals meanwhile, but it doesn't
+       exec anything. */
+    if (sub == builtinBinaryCache) {
 
-    /* Fork the substitute program. */
-    pid = maybeVfork();
+        pid = fork();
 
-    switch (pid) {
+        switch (pid) {
 
-    case -1:
-        throw SysError("unable to fork");
+        case -1:
+            throw SysError("unable to fork");
 
-    case 0:
-        try { /* child */
+        case 0:
+            try { /* child */
 
-            commonChildInit(logPipe);
+                commonChildInit(logPipe);
 
-            if (dup2(outPipe.writeSide, STDOUT_FILENO) == -1)
-                throw SysError("cannot dup output pipe into stdout");
+                if (dup2(outPipe.writeSide, STDOUT_FILENO) == -1)
+                    throw SysError("cannot dup output pipe into stdout");
 
-            execv(sub.c_str(), (char * *) argArr);
+                writeLine(STDOUT_FILENO,
+                    worker.store.substituteFromBinaryCache(storePath, destPath));
 
-            throw SysError(format("executing `%1%'") % sub);
+                _exit(0);
 
-        } catch (std::exception & e) {
-            writeToStderr("substitute error: " + string(e.what()) + "\n");
+            } catch (std::exception & e) {
+                writeToStderr("substitute error: " + string(e.what()) + "\n");
+            }
+            _exit(1);
+        }
+
+    } else {
+
+        /* Fill in the arguments. */
+        Strings args;
+        args.push_back(baseNameOf(sub));
+        args.push_back("--substitute");
+        args.push_back(storePath);
+        args.push_back(destPath);
+        const char * * argArr = strings2CharPtrs(args);
+
+        /* Fork the substitute program. */
+        pid = maybeVfork();
+
+        switch (pid) {
+
+        case -1:
+            throw SysError("unable to fork");
+
+        case 0:
+            try { /* child */
+
+                commonChildInit(logPipe);
+
+                if (dup2(outPipe.writeSide, STDOUT_FILENO) == -1)
+                    throw SysError("cannot dup output pipe into stdout");
+
+                execv(sub.c_str(), (char * *) argArr);
+
+                throw SysError(format("executing `%1%'") % sub);
+
+            } catch (std::exception & e) {
+                writeToStderr("substitute error: " + string(e.what()) + "\n");
+            }
+            _exit(1);
         }
-        _exit(1);
     }
 
     /* parent */
@@ -2742,8 +3132,9 @@ void SubstitutionGoal::tryToRun()
     pid.setKillSignal(SIGTERM);
     outPipe.writeSide.close();
     logPipe.writeSide.close();
+    bool ownSlots = settings.maxSubstitutionJobs != 0;
     worker.childStarted(shared_from_this(),
-        pid, singleton<set<int> >(logPipe.readSide), true, true);
+        pid, singleton<set<int> >(logPipe.readSide), !ownSlots, true, ownSlots);
 
     state = &SubstitutionGoal::finished;
 
@@ -2773,8 +3164,11 @@ void SubstitutionGoal::finished()
     string expectedHashStr = statusOk(status) ? readLine(outPipe.readSide) : "";
     outPipe.readSide.close();
 
-    /* Check the exit status and the build result. */
+    /* Check the exit status and the build result.  The file hashes
+       needed by optimisePath() are computed along with the NAR
+       hash. */
     HashResult hash;
+    FileHashSink fileHashes(settings.autoOptimiseStore);
     try {
 
         if (!statusOk(status))
@@ -2784,7 +3178,9 @@ void SubstitutionGoal::finished()
         if (!pathExists(destPath))
             throw SubstError(format("substitute did not produce path `%1%'") % destPath);
 
-        hash = hashPath(htSHA256, destPath);
+        HashSink sink(htSHA256);
+        dumpPath(destPath, sink, fileHashes);
+        hash = sink.finish();
 
         /* Verify the expected hash we got from the substituer. */
         if (expectedHashStr != "") {
@@ -2818,7 +3214,7 @@ void SubstitutionGoal::finished()
 
     canonicalisePathMetaData(destPath);
 
-    worker.store.optimisePath(destPath); // FIXME: combine with hashPath()
+    worker.store.optimisePath(destPath, fileHashes);
 
     if (repair) replaceValidPath(storePath, destPath);
 
@@ -2874,8 +3270,16 @@ Worker::Worker(LocalStore & store)
     if (working) abort();
     working = true;
     nrLocalBuilds = 0;
+    nrSubstitutions = 0;
+    slotAvailable = false;
     lastWokenUp = 0;
     permanentFailure = false;
+    runStart = lastSlotChange = busySlotTime = 0;
+    nrSlotJobs = maxLocalBuilds = 0;
+#if HAVE_SYS_EPOLL_H
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd == -1) throw SysError("creating epoll instance");
+#endif
 }
 
 
@@ -2965,18 +3369,96 @@ unsigned Worker::getNrLocalBuilds()
 }
 
 
+/* Return the number of processes waiting for a CPU, averaged over
+   the last minute, or -1 if unknown. */
+static double getLoadAverage()
+{
+    string s;
+    try {
+        s = readFile("/proc/loadavg");
+    } catch (SysError & e) {
+        return -1;
+    }
+    double load;
+    return sscanf(s.c_str(), "%lf", &load) == 1 ? load : -1;
+}
+
+
+unsigned int Worker::getBuildCores()
+{
+    if (!settings.dynamicBuildCores) return settings.buildCores;
+
+    unsigned int nrCores = getNrCores();
+
+    /* Share the cores between this build, the running ones and the
+       ones waiting for a build slot, as far as they fit in the build
+       slots.  So near the end of a run, the last builds get all the
+       cores. */
+    unsigned int builds = nrLocalBuilds + 1 + wantingToBuild.size();
+    if (settings.maxBuildJobs != 0) builds = std::min(builds, settings.maxBuildJobs);
+    unsigned int cores = std::max(nrCores / builds, 1U);
+
+    /* But don't hand out cores that are busy, be it with the running
+       builds or with work that isn't ours. */
+    double load = getLoadAverage();
+    if (load >= 0)
+        cores = std::min(cores, (unsigned int) std::max(nrCores - load + 0.5, 1.0));
+
+    return settings.buildCores == 0 ? cores : std::min(cores, settings.buildCores);
+}
+
+
+void Worker::updateJobservers()
+{
+    if (jobservers.empty()) return;
+    unsigned int nrCores = getNrCores();
+    unsigned int idle = nrLocalBuilds < nrCores ? nrCores - nrLocalBuilds : 0;
+    unsigned int n = 0;
+    foreach (Jobservers::iterator, i, jobservers)
+        (*i)->setTokens(idle / jobservers.size() + (n++ < idle % jobservers.size() ? 1 : 0));
+}
+
+
+void Worker::addJobserver(Jobserver & jobserver)
+{
+    jobservers.insert(&jobserver);
+    updateJobservers();
+}
+
+
+void Worker::removeJobserver(Jobserver & jobserver)
+{
+    /* Whatever tokens the builder still holds (e.g. because it was
+       killed) go away with its jobserver; the other builds get them
+       instead. */
+    if (jobservers.erase(&jobserver)) updateJobservers();
+}
+
+
 void Worker::childStarted(GoalPtr goal,
     pid_t pid, const set<int> & fds, bool inBuildSlot,
-    bool monitorForSilence)
+    bool monitorForSilence, bool inSubstitutionSlot)
 {
     Child child;
     child.goal = goal;
     child.fds = fds;
     child.lastOutput = time(0);
     child.inBuildSlot = inBuildSlot;
+    child.inSubstitutionSlot = inSubstitutionSlot;
     child.monitorForSilence = monitorForSilence;
+    child.readSize = 4096;
     children[pid] = child;
-    if (inBuildSlot) nrLocalBuilds++;
+    foreach (set<int>::const_iterator, i, fds) watchFd(*i, pid);
+    if (monitorForSilence)
+        silentChildren.insert(std::make_pair(child.lastOutput, pid));
+    if (inBuildSlot) {
+        updateSlotStats();
+        nrLocalBuilds++;
+        nrSlotJobs++;
+        maxLocalBuilds = std::max(maxLocalBuilds, nrLocalBuilds);
+        updateJobservers();
+    }
+    if (inSubstitutionSlot) nrSubstitutions++;
 }
 
 
@@ -2989,31 +3471,82 @@ void Worker::childTerminated(pid_t pid, bool wakeSleepers)
 
     if (i->second.inBuildSlot) {
         assert(nrLocalBuilds > 0);
+        updateSlotStats();
         nrLocalBuilds--;
+        updateJobservers();
     }
 
-    children.erase(pid);
+    if (i->second.inSubstitutionSlot) {
+        assert(nrSubstitutions > 0);
+        nrSubstitutions--;
+    }
 
-    if (wakeSleepers) {
+    foreach (set<int>::iterator, j, i->second.fds) unwatchFd(*j);
+    silentChildren.erase(std::make_pair(i->second.lastOutput, pid));
 
-        /* Wake up goals waiting for a build slot. */
-        foreach (WeakGoals::iterator, i, wantingToBuild) {
-            GoalPtr goal = i->lock();
-            if (goal) wakeUp(goal);
-        }
+    children.erase(i);
 
-        wantingToBuild.clear();
-    }
+    /* Wake up goals waiting for a build slot, but only after the
+       goals that are awake have run, since they may include goals
+       that want the slot more (e.g. the goals waiting for the one
+       that just finished). */
+    if (wakeSleepers) slotAvailable = true;
 }
 
 
 void Worker::waitForBuildSlot(GoalPtr goal)
 {
     debug("wait for build slot");
-    if (getNrLocalBuilds() < settings.maxBuildJobs)
-        wakeUp(goal); /* we can do it right away */
-    else
-        wantingToBuild.insert(goal);
+    wantingToBuild.insert(goal);
+    /* If there is a free slot, it goes to the goal with the highest
+       priority once the awake goals have run. */
+    if (getNrLocalBuilds() < settings.maxBuildJobs) slotAvailable = true;
+}
+
+
+GoalPriority Worker::getPriority(GoalPtr goal)
+{
+    GoalPriority p;
+    p.goal = goal;
+    p.criticalPath = goal->getCriticalPath(criticalPaths);
+    p.nrWaiters = goal->getNrWaiters();
+    return p;
+}
+
+
+/* Return false if a goal in `waiting' has a higher priority than
+   `goal'. */
+bool Worker::hasPriority(GoalPtr goal, const WeakGoals & waiting)
+{
+    GoalPriority p = getPriority(goal);
+    foreach (WeakGoals::const_iterator, i, waiting) {
+        GoalPtr other = i->lock();
+        if (other && other != goal && getPriority(other) < p) return false;
+    }
+    return true;
+}
+
+
+bool Worker::mayTakeBuildSlot(GoalPtr goal)
+{
+    /* With no local build slots, substitutions and local builds
+       have limits of their own; let them be. */
+    if (settings.maxBuildJobs == 0) return true;
+    return hasPriority(goal, wantingToBuild);
+}
+
+
+void Worker::waitForSubstitutionSlot(GoalPtr goal)
+{
+    debug("wait for substitution slot");
+    wantingToSubstitute.insert(goal);
+    if (nrSubstitutions < settings.maxSubstitutionJobs) slotAvailable = true;
+}
+
+
+bool Worker::mayTakeSubstitutionSlot(GoalPtr goal)
+{
+    return hasPriority(goal, wantingToSubstitute);
 }
 
 
@@ -3031,12 +3564,42 @@ void Worker::waitForAWhile(GoalPtr goal)
 }
 
 
+static double getTime()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+
+void Worker::updateSlotStats()
+{
+    double now = getTime();
+    busySlotTime += nrLocalBuilds * (now - lastSlotChange);
+    lastSlotChange = now;
+}
+
+
+void Worker::printSlotStats()
+{
+    updateSlotStats();
+    double elapsed = lastSlotChange - runStart;
+    if (nrSlotJobs == 0 || elapsed <= 0) return;
+    unsigned int slots = std::max(settings.maxBuildJobs, 1U);
+    printMsg(lvlTalkative,
+        format("%1% jobs used %2$.1f of %3% build slots on average (at most %4%) over %5$.1f seconds")
+        % nrSlotJobs % (busySlotTime / elapsed) % slots % maxLocalBuilds % elapsed);
+}
+
+
 void Worker::run(const Goals & _topGoals)
 {
     foreach (Goals::iterator, i,  _topGoals) topGoals.insert(*i);
 
     startNest(nest, lvlDebug, format("entered goal loop"));
 
+    runStart = lastSlotChange = getTime();
+
     while (1) {
 
         checkInterrupt();
@@ -3045,9 +3608,20 @@ void Worker::run(const Goals & _topGoals)
         while (!awake.empty() && !topGoals.empty()) {
             WeakGoals awake2(awake);
             awake.clear();
+
+            /* Run the goals in order of priority, so that those on
+               the critical path get the free build slots. */
+            criticalPaths.clear();
+            vector<GoalPriority> goals;
             foreach (WeakGoals::iterator, i, awake2) {
-                checkInterrupt();
                 GoalPtr goal = i->lock();
+                if (goal) goals.push_back(getPriority(goal));
+            }
+            stable_sort(goals.begin(), goals.end());
+
+            foreach (vector<GoalPriority>::iterator, i, goals) {
+                checkInterrupt();
+                GoalPtr goal = i->goal.lock();
                 if (goal) goal->work();
                 if (topGoals.empty()) break;
             }
@@ -3055,6 +3629,25 @@ void Worker::run(const Goals & _topGoals)
 
         if (topGoals.empty()) break;
 
+        /* Now that the awake goals have run, let the goals waiting
+           for a build slot compete for the free ones. */
+        if (slotAvailable) {
+            slotAvailable = false;
+            if (!wantingToBuild.empty() || !wantingToSubstitute.empty()) {
+                foreach (WeakGoals::iterator, i, wantingToBuild) {
+                    GoalPtr goal = i->lock();
+                    if (goal) wakeUp(goal);
+                }
+                wantingToBuild.clear();
+                foreach (WeakGoals::iterator, i, wantingToSubstitute) {
+                    GoalPtr goal = i->lock();
+                    if (goal) wakeUp(goal);
+                }
+                wantingToSubstitute.clear();
+                continue;
+            }
+        }
+
         /* Wait for input. */
         if (!children.empty() || !waitingForAWhile.empty())
             waitForInput();
@@ -3071,7 +3664,37 @@ void Worker::run(const Goals & _topGoals)
        --keep-going *is* set, then they must all be finished now. */
     assert(!settings.keepGoing || awake.empty());
     assert(!settings.keepGoing || wantingToBuild.empty());
+    assert(!settings.keepGoing || wantingToSubstitute.empty());
     assert(!settings.keepGoing || children.empty());
+
+    printSlotStats();
+}
+
+
+void Worker::watchFd(int fd, pid_t pid)
+{
+    childFds[fd] = pid;
+#if HAVE_SYS_EPOLL_H
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) == -1)
+        throw SysError(format("watching file descriptor %1%") % fd);
+#endif
+}
+
+
+void Worker::unwatchFd(int fd)
+{
+    childFds.erase(fd);
+#if HAVE_SYS_EPOLL_H
+    /* This is called from goal destructors, so don't throw.  It can
+       only fail if the file descriptor has been closed already, in
+       which case the kernel has forgotten about it. */
+    struct epoll_event event;
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, &event);
+#endif
 }
 
 
@@ -3086,35 +3709,24 @@ void Worker::waitForInput()
        terminated. */
 
     bool useTimeout = false;
-    struct timeval timeout;
-    timeout.tv_usec = 0;
+    time_t timeout = 0;
     time_t before = time(0);
 
     /* If a global timeout has been set, sleep until it's done.  */
     if (settings.buildTimeout != 0) {
         useTimeout = true;
         if (lastWait == 0 || lastWait > before) lastWait = before;
-        timeout.tv_sec = std::max((time_t) 0, lastWait + settings.buildTimeout - before);
+        timeout = std::max((time_t) 0, lastWait + settings.buildTimeout - before);
     }
 
     /* If we're monitoring for silence on stdout/stderr, sleep until
        the first deadline for any child. */
-    if (settings.maxSilentTime != 0) {
-        time_t oldest = 0;
-        foreach (Children::iterator, i, children) {
-            if (i->second.monitorForSilence) {
-                oldest = oldest == 0 || i->second.lastOutput < oldest
-                    ? i->second.lastOutput : oldest;
-            }
-        }
-        if (oldest) {
-            time_t silenceTimeout = std::max((time_t) 0, oldest + settings.maxSilentTime - before);
-            timeout.tv_sec = useTimeout
-                ? std::min(silenceTimeout, timeout.tv_sec)
-                : silenceTimeout;
-            useTimeout = true;
-            printMsg(lvlVomit, format("sleeping %1% seconds") % timeout.tv_sec);
-        }
+    if (settings.maxSilentTime != 0 && !silentChildren.empty()) {
+        time_t silenceTimeout = std::max((time_t) 0,
+            silentChildren.begin()->first + settings.maxSilentTime - before);
+        timeout = useTimeout ? std::min(silenceTimeout, timeout) : silenceTimeout;
+        useTimeout = true;
+        printMsg(lvlVomit, format("sleeping %1% seconds") % timeout);
     }
 
     /* If we are polling goals that are waiting for a lock, then wake
@@ -3124,85 +3736,92 @@ void Worker::waitForInput()
         if (lastWokenUp == 0)
             printMsg(lvlError, "waiting for locks or build slots...");
         if (lastWokenUp == 0 || lastWokenUp > before) lastWokenUp = before;
-        timeout.tv_sec = std::max((time_t) 0, (time_t) (lastWokenUp + settings.pollInterval - before));
+        timeout = std::max((time_t) 0, (time_t) (lastWokenUp + settings.pollInterval - before));
     } else lastWokenUp = 0;
 
-    using namespace std;
-    /* Use select() to wait for the input side of any logger pipe to
-       become `available'.  Note that `available' (i.e., non-blocking)
+    /* Wait for the input side of any logger pipe to become
+       `available'.  Note that `available' (i.e., non-blocking)
        includes EOF. */
+    vector<int> ready;
+
+#if HAVE_SYS_EPOLL_H
+    if (events.size() < std::max(childFds.size(), (size_t) 1))
+        events.resize(std::max(childFds.size(), (size_t) 1));
+
+    int n = epoll_wait(epollFd, &events[0], events.size(),
+        useTimeout ? std::min(timeout, (time_t) INT_MAX / 1000) * 1000 : -1);
+    if (n == -1) {
+        if (errno == EINTR) return;
+        throw SysError("waiting for input");
+    }
+
+    for (int i = 0; i < n; ++i) ready.push_back(events[i].data.fd);
+#else
     fd_set fds;
     FD_ZERO(&fds);
     int fdMax = 0;
-    foreach (Children::iterator, i, children) {
-        foreach (set<int>::iterator, j, i->second.fds) {
-            FD_SET(*j, &fds);
-            if (*j >= fdMax) fdMax = *j + 1;
-        }
+    foreach (ChildFds::iterator, i, childFds) {
+        FD_SET(i->first, &fds);
+        if (i->first >= fdMax) fdMax = i->first + 1;
     }
 
-    if (select(fdMax, &fds, 0, 0, useTimeout ? &timeout : 0) == -1) {
+    struct timeval tv;
+    tv.tv_sec = timeout;
+    tv.tv_usec = 0;
+
+    if (select(fdMax, &fds, 0, 0, useTimeout ? &tv : 0) == -1) {
         if (errno == EINTR) return;
         throw SysError("waiting for input");
     }
 
+    foreach (ChildFds::iterator, i, childFds)
+        if (FD_ISSET(i->first, &fds)) ready.push_back(i->first);
+#endif
+
     time_t after = time(0);
 
     /* Keep track of when we were last called.  */
     lastWait = after;
 
-    /* Process all available file descriptors. */
-
-    /* Since goals may be canceled from inside the loop below (causing
-       them go be erased from the `children' map), we have to be
-       careful that we don't keep iterators alive across calls to
-       cancel(). */
-    set<pid_t> pids;
-    foreach (Children::iterator, i, children) pids.insert(i->first);
+    foreach (Jobservers::iterator, i, jobservers)
+        (*i)->reclaim();
 
-    foreach (set<pid_t>::iterator, i, pids) {
+    /* Process all available file descriptors. */
+    foreach (vector<int>::iterator, i, ready) {
         checkInterrupt();
-        Children::iterator j = children.find(*i);
-        if (j == children.end()) continue; // child destroyed
-        GoalPtr goal = j->second.goal.lock();
-        assert(goal);
-
-        set<int> fds2(j->second.fds);
-        foreach (set<int>::iterator, k, fds2) {
-            if (FD_ISSET(*k, &fds)) {
-                unsigned char buffer[4096];
-                ssize_t rd = read(*k, buffer, sizeof(buffer));
-                if (rd == -1) {
-                    if (errno != EINTR)
-                        throw SysError(format("reading from %1%")
-                            % goal->getName());
-                } else if (rd == 0) {
-                    debug(format("%1%: got EOF") % goal->getName());
-                    goal->handleEOF(*k);
-                    j->second.fds.erase(*k);
-                } else {
-                    printMsg(lvlVomit, format("%1%: read %2% bytes")
-                        % goal->getName() % rd);
-                    string data((char *) buffer, rd);
-                    goal->handleChildOutput(*k, data);
-                    j->second.lastOutput = after;
-                }
-            }
-        }
+        handleChildInput(*i, after);
+    }
 
-        if (settings.maxSilentTime != 0 &&
-            j->second.monitorForSilence &&
-            after - j->second.lastOutput >= (time_t) settings.maxSilentTime)
+    /* Since goals may be canceled below (causing them go be erased
+       from the `children' map), we have to be careful that we don't
+       keep iterators alive across calls to cancel(). */
+    if (settings.maxSilentTime != 0)
+        while (!silentChildren.empty() &&
+            after - silentChildren.begin()->first >= (time_t) settings.maxSilentTime)
         {
+            pid_t pid = silentChildren.begin()->second;
+            silentChildren.erase(silentChildren.begin());
+            Children::iterator j = children.find(pid);
+            assert(j != children.end());
+            GoalPtr goal = j->second.goal.lock();
+            assert(goal);
             printMsg(lvlError,
                 format("%1% timed out after %2% seconds of silence")
                 % goal->getName() % settings.maxSilentTime);
             goal->cancel();
         }
 
-        if (settings.buildTimeout != 0 &&
-            after - before >= (time_t) settings.buildTimeout)
-        {
+    if (settings.buildTimeout != 0 &&
+        after - before >= (time_t) settings.buildTimeout)
+    {
+        set<pid_t> pids;
+        foreach (Children::iterator, i, children) pids.insert(i->first);
+
+        foreach (set<pid_t>::iterator, i, pids) {
+            Children::iterator j = children.find(*i);
+            if (j == children.end()) continue; // child destroyed
+            GoalPtr goal = j->second.goal.lock();
+            assert(goal);
             printMsg(lvlError,
                 format("%1% timed out after %2% seconds of activity")
                 % goal->getName() % settings.buildTimeout);
@@ -3221,6 +3840,52 @@ void Worker::waitForInput()
 }
 
 
+void Worker::handleChildInput(int fd, time_t now)
+{
+    ChildFds::iterator i = childFds.find(fd);
+    if (i == childFds.end()) return; // child destroyed
+    pid_t pid = i->second;
+
+    Children::iterator j = children.find(pid);
+    assert(j != children.end());
+    Child & child(j->second);
+    GoalPtr goal = child.goal.lock();
+    assert(goal);
+
+    if (readBuffer.size() < child.readSize) readBuffer.resize(child.readSize);
+
+    ssize_t rd = read(fd, &readBuffer[0], child.readSize);
+    if (rd == -1) {
+        if (errno != EINTR)
+            throw SysError(format("reading from %1%")
+                % goal->getName());
+    } else if (rd == 0) {
+        debug(format("%1%: got EOF") % goal->getName());
+        unwatchFd(fd);
+        child.fds.erase(fd);
+        goal->handleEOF(fd);
+    } else {
+        printMsg(lvlVomit, format("%1%: read %2% bytes")
+            % goal->getName() % rd);
+
+        /* A child that fills the buffer probably has more output
+           waiting, so read more at a time from it, up to the size of
+           a pipe buffer. */
+        if ((size_t) rd == child.readSize && child.readSize < 65536)
+            child.readSize *= 2;
+
+        if (child.monitorForSilence) {
+            silentChildren.erase(std::make_pair(child.lastOutput, pid));
+            silentChildren.insert(std::make_pair(now, pid));
+        }
+        child.lastOutput = now;
+
+        string data((char *) &readBuffer[0], rd);
+        goal->handleChildOutput(fd, data);
+    }
+}
+
+
 unsigned int Worker::exitStatus()
 {
     return permanentFailure ? 100 : 1;
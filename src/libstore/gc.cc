@@ -2,6 +2,7 @@
 #include "misc.hh"
 #include "local-store.hh"
 #include "immutable.hh"
+#include "thread-pool.hh"
 
 #include <boost/shared_ptr.hpp>
 
@@ -11,6 +12,7 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -390,19 +392,163 @@ static void addAdditionalRoots(StoreAPI & store, PathSet & roots)
 struct GCLimitReached { };
 
 
+/* Adjacency lists over the nodes of a PathGraph, stored in two flat
+   arrays: the successors of node `n' are `edges[start[n]]' up to (but
+   not including) `edges[start[n + 1]]'. */
+struct Adjacency
+{
+    std::vector<unsigned int> start, edges;
+
+    /* Build the lists from (from, to) pairs, or from (to, from) pairs
+       if `flip' is set. */
+    void build(size_t nodes, const PathGraph::Edges & pairs, bool flip)
+    {
+        start.assign(nodes + 1, 0);
+        foreach (PathGraph::Edges::const_iterator, i, pairs)
+            start[(flip ? i->second : i->first) + 1]++;
+        for (size_t n = 0; n < nodes; ++n) start[n + 1] += start[n];
+        std::vector<unsigned int> pos(start.begin(), start.end() - 1);
+        edges.resize(pairs.size());
+        foreach (PathGraph::Edges::const_iterator, i, pairs)
+            if (flip)
+                edges[pos[i->second]++] = i->first;
+            else
+                edges[pos[i->first]++] = i->second;
+    }
+};
+
+
+typedef std::vector<const Adjacency *> Adjacencies;
+
+
+/* Set `marks' for the nodes in `todo' and for everything reachable
+   from them along the edges in `adjs'. */
+static void markReachable(std::vector<unsigned int> todo,
+    const Adjacencies & adjs, std::vector<bool> & marks)
+{
+    while (!todo.empty()) {
+        unsigned int n = todo.back();
+        todo.pop_back();
+        if (marks[n]) continue;
+        marks[n] = true;
+        foreach (Adjacencies::const_iterator, i, adjs)
+            for (unsigned int e = (*i)->start[n]; e < (*i)->start[n + 1]; ++e)
+                if (!marks[(*i)->edges[e]]) todo.push_back((*i)->edges[e]);
+    }
+}
+
+
+/* Return `nodes' ordered such that every path comes before the paths
+   it references, so that each path can be invalidated without
+   violating the closure invariant.  All referrers of `nodes' must be
+   in `nodes'. */
+static std::vector<unsigned int> sortForDeletion(
+    const std::vector<unsigned int> & nodes, const Adjacency & referrers)
+{
+    enum { unselected, pending, visiting, done };
+    std::vector<char> status(referrers.start.size() - 1, unselected);
+    foreach (std::vector<unsigned int>::const_iterator, i, nodes)
+        status[*i] = pending;
+
+    std::vector<unsigned int> sorted;
+    sorted.reserve(nodes.size());
+
+    /* Depth-first search along the referrers, emitting each node
+       after all of its referrers. */
+    std::vector<std::pair<unsigned int, unsigned int> > stack;
+    foreach (std::vector<unsigned int>::const_iterator, i, nodes) {
+        if (status[*i] != pending) continue;
+        status[*i] = visiting;
+        stack.push_back(std::make_pair(*i, referrers.start[*i]));
+        while (!stack.empty()) {
+            unsigned int n = stack.back().first;
+            unsigned int & e = stack.back().second;
+            if (e < referrers.start[n + 1]) {
+                unsigned int m = referrers.edges[e++];
+                if (status[m] == pending) {
+                    status[m] = visiting;
+                    stack.push_back(std::make_pair(m, referrers.start[m]));
+                }
+            } else {
+                status[n] = done;
+                sorted.push_back(n);
+                stack.pop_back();
+            }
+        }
+    }
+
+    return sorted;
+}
+
+
+/* Orders nodes by ascending key. */
+struct CompareKeys
+{
+    const std::vector<long long> & keys;
+    CompareKeys(const std::vector<long long> & keys) : keys(keys) { }
+    bool operator () (unsigned int a, unsigned int b) const
+    {
+        return keys[a] < keys[b];
+    }
+};
+
+
 struct LocalStore::GCState
 {
     GCOptions options;
     GCResults & results;
     PathSet roots;
     PathSet tempRoots;
-    PathSet deleted;
-    PathSet live;
-    PathSet busy;
     PathSet invalidated;
     bool gcKeepOutputs;
     bool gcKeepDerivations;
     unsigned long long bytesInvalidated;
+
+    /* The valid paths and their index in `graph.paths'. */
+    PathGraph graph;
+    std::map<Path, unsigned int> nodes;
+
+    Adjacency references, referrers, outputs, derivers;
+
+    /* The edges along which liveness propagates, and their reverse.
+       A live path keeps its references alive.  If gc-keep-outputs is
+       set, a live derivation keeps its outputs alive, and if
+       gc-keep-derivations is set, a live output keeps its derivers
+       alive. */
+    Adjacencies keepsAlive, keptAliveBy;
+
+    /* Whether each valid path is reachable from the roots. */
+    std::vector<bool> live;
+
+    /* Sort the dead nodes in the order in which they should be
+       deleted according to `options.order'.  Ties are broken
+       randomly. */
+    void orderDead(std::vector<unsigned int> & dead)
+    {
+        random_shuffle(dead.begin(), dead.end());
+        if (options.order == GCOptions::gcOrderRandom) return;
+
+        std::vector<long long> keys(graph.paths.size(), 0);
+        foreach (std::vector<unsigned int>::iterator, i, dead)
+            switch (options.order) {
+                case GCOptions::gcOrderOldest:
+                    keys[*i] = graph.registrationTimes[*i];
+                    break;
+                case GCOptions::gcOrderLargest:
+                    keys[*i] = -(long long) graph.narSizes[*i];
+                    break;
+                case GCOptions::gcOrderAtime: {
+                    struct stat st;
+                    keys[*i] = lstat(graph.paths[*i].c_str(), &st) == 0 ? st.st_atime : 0;
+                    break;
+                }
+                default:
+                    throw Error("invalid GC order");
+            }
+
+        std::stable_sort(dead.begin(), dead.end(), CompareKeys(keys));
+    }
+
     GCState(GCResults & results_) : results(results_), bytesInvalidated(0) { }
 };
 
@@ -431,146 +577,160 @@ void LocalStore::deleteGarbage(GCState & state, const Path & path)
 }
 
 
-bool LocalStore::tryToDelete(GCState & state, const Path & path)
+static void checkLimit(GCOptions & options, GCResults & results,
+    unsigned long long bytesInvalidated)
+{
+    if (results.bytesFreed + bytesInvalidated > options.maxFreed) {
+        printMsg(lvlInfo, format("deleted or invalidated more than %1% bytes; stopping") % options.maxFreed);
+        throw GCLimitReached();
+    }
+}
+
+
+/* Delete a dead valid path.  All of its referrers must have been
+   deleted already. */
+void LocalStore::deleteValidPath(GCState & state, unsigned int node)
 {
     checkInterrupt();
 
-    if (path == linksDir) return true;
+    const Path & path = state.graph.paths[node];
 
-    struct stat st;
-    if (lstat(path.c_str(), &st)) {
-        if (errno == ENOENT) return true;
-        throw SysError(format("getting status of %1%") % path);
-    }
+    if (shouldDelete(state.options.action)) {
 
-    if (state.deleted.find(path) != state.deleted.end()) return true;
-    if (state.live.find(path) != state.live.end()) return false;
-
-    startNest(nest, lvlDebug, format("considering whether to delete `%1%'") % path);
-
-    /* If gc-keep-outputs and gc-keep-derivations are both set, we can
-       have cycles in the liveness graph, so we need to treat such
-       strongly connected components as a single unit (‘paths’).  That
-       is, we can delete the elements of ‘paths’ only if all referrers
-       of ‘paths’ are garbage. */
-    PathSet paths, referrers;
-    Paths pathsSorted;
-
-    if (isValidPath(path)) {
-
-        /* Add derivers and outputs of ‘path’ to ‘paths’. */
-        PathSet todo;
-        todo.insert(path);
-        while (!todo.empty()) {
-            Path p = *todo.begin();
-            assertStorePath(p);
-            todo.erase(p);
-            if (paths.find(p) != paths.end()) continue;
-            paths.insert(p);
-            /* If gc-keep-derivations is set and this is a derivation,
-               then don't delete the derivation if any of the outputs
-               are live. */
-            if (state.gcKeepDerivations && isDerivation(p)) {
-                PathSet outputs = queryDerivationOutputs(p);
-                foreach (PathSet::iterator, i, outputs)
-                    if (isValidPath(*i)) todo.insert(*i);
-            }
-            /* If gc-keep-outputs is set, then don't delete this path
-               if there are derivers of this path that are not
-               garbage. */
-            if (state.gcKeepOutputs) {
-                PathSet derivers = queryValidDerivers(p);
-                foreach (PathSet::iterator, i, derivers) todo.insert(*i);
-            }
+        struct stat st;
+        if (lstat(path.c_str(), &st)) {
+            if (errno != ENOENT)
+                throw SysError(format("getting status of %1%") % path);
+            printMsg(lvlInfo, format("invalidating missing path `%1%'") % path);
+            invalidatePathChecked(path);
         }
-    }
 
-    else {
-        /* A lock file belonging to a path that we're building right
-           now isn't garbage. */
-        if (isActiveTempFile(state, path, ".lock")) return false;
+        /* If it's not a regular file or symlink, invalidate it,
+           rename it, and schedule it for deletion.  The renaming is
+           to ensure that later (when we're not holding the global GC
+           lock) we can delete the path without being afraid that the
+           path has become alive again.  Otherwise delete it right
+           away. */
+        else if (S_ISDIR(st.st_mode)) {
+            printMsg(lvlInfo, format("invalidating `%1%'") % path);
+            // Estimate the amount freed using the narSize field.
+            state.bytesInvalidated += state.graph.narSizes[node];
+            invalidatePathChecked(path);
+            makeMutable(path.c_str());
+            // Mac OS X cannot rename directories if they are read-only.
+            if (chmod(path.c_str(), st.st_mode | S_IWUSR) == -1)
+                throw SysError(format("making `%1%' writable") % path);
+            Path tmp = (format("%1%-gc-%2%") % path % getpid()).str();
+            if (rename(path.c_str(), tmp.c_str()))
+                throw SysError(format("unable to rename `%1%' to `%2%'") % path % tmp);
+            state.invalidated.insert(tmp);
+        }
+
+        else {
+            invalidatePathChecked(path);
+            deleteGarbage(state, path);
+        }
+
+        checkLimit(state.options, state.results, state.bytesInvalidated);
+
+    } else
+        printMsg(lvlTalkative, format("would delete `%1%'") % path);
+
+    if (state.options.action != GCOptions::gcReturnLive)
+        state.results.paths.insert(path);
+}
+
+
+/* Return whether an entry in the store that is not a valid path is
+   garbage. */
+bool LocalStore::canDeleteInvalid(GCState & state, const Path & path)
+{
+    /* A lock file belonging to a path that we're building right
+       now isn't garbage. */
+    if (isActiveTempFile(state, path, ".lock")) return false;
 
-        /* Don't delete .chroot directories for derivations that are
-           currently being built. */
-        if (isActiveTempFile(state, path, ".chroot")) return false;
+    /* Don't delete .chroot directories for derivations that are
+       currently being built. */
+    if (isActiveTempFile(state, path, ".chroot")) return false;
 
-        paths.insert(path);
+    if (state.roots.find(path) != state.roots.end()) {
+        printMsg(lvlDebug, format("cannot delete `%1%' because it's a root") % path);
+        return false;
     }
 
-    /* Check if any path in ‘paths’ is a root. */
-    foreach (PathSet::iterator, i, paths)
-        if (state.roots.find(*i) != state.roots.end()) {
-            printMsg(lvlDebug, format("cannot delete `%1%' because it's a root") % *i);
-            goto isLive;
-        }
+    return true;
+}
 
-    /* Recursively try to delete the referrers of this strongly
-       connected component.  If any referrer can't be deleted, then
-       these paths can't be deleted either. */
-    foreach (PathSet::iterator, i, paths)
-        if (isValidPath(*i)) queryReferrers(*i, referrers);
 
-    foreach (PathSet::iterator, i, referrers)
-        if (paths.find(*i) == paths.end() && !tryToDelete(state, *i)) {
-            printMsg(lvlDebug, format("cannot delete `%1%' because it has live referrers") % *i);
-            goto isLive;
-        }
+void LocalStore::deleteInvalidPath(GCState & state, const Path & path)
+{
+    checkInterrupt();
 
-    /* The paths are garbage, so delete them. */
-    pathsSorted = topoSortPaths(*this, paths);
-    foreach (Paths::iterator, i, pathsSorted) {
-        if (shouldDelete(state.options.action)) {
-
-            /* If it's a valid path that's not a regular file or
-               symlink, invalidate it, rename it, and schedule it for
-               deletion.  The renaming is to ensure that later (when
-               we're not holding the global GC lock) we can delete the
-               path without being afraid that the path has become
-               alive again.  Otherwise delete it right away. */
-            if (isValidPath(*i)) {
-                if (S_ISDIR(st.st_mode)) {
-                    printMsg(lvlInfo, format("invalidating `%1%'") % *i);
-                    // Estimate the amount freed using the narSize field.
-                    state.bytesInvalidated += queryPathInfo(*i).narSize;
-                    invalidatePathChecked(*i);
-                    makeMutable(i->c_str());
-                    // Mac OS X cannot rename directories if they are read-only.
-                    if (chmod(i->c_str(), st.st_mode | S_IWUSR) == -1)
-                        throw SysError(format("making `%1%' writable") % *i);
-                    Path tmp = (format("%1%-gc-%2%") % *i % getpid()).str();
-                    if (rename(i->c_str(), tmp.c_str()))
-                        throw SysError(format("unable to rename `%1%' to `%2%'") % *i % tmp);
-                    state.invalidated.insert(tmp);
-                } else {
-                    invalidatePathChecked(*i);
-                    deleteGarbage(state, *i);
-                }
-            } else
-                deleteGarbage(state, *i);
+    if (shouldDelete(state.options.action)) {
+        deleteGarbage(state, path);
+        checkLimit(state.options, state.results, state.bytesInvalidated);
+    } else
+        printMsg(lvlTalkative, format("would delete `%1%'") % path);
 
-            if (state.results.bytesFreed + state.bytesInvalidated > state.options.maxFreed) {
-                printMsg(lvlInfo, format("deleted or invalidated more than %1% bytes; stopping") % state.options.maxFreed);
-                throw GCLimitReached();
-            }
+    if (state.options.action != GCOptions::gcReturnLive)
+        state.results.paths.insert(path);
+}
 
-        } else
-            printMsg(lvlTalkative, format("would delete `%1%'") % *i);
 
-        state.deleted.insert(*i);
-        if (state.options.action != GCOptions::gcReturnLive)
-            state.results.paths.insert(*i);
+/* Bookkeeping shared by the DeleteWork items of a collection. */
+struct DeletionStatus
+{
+    /* Also serialises the messages of the workers. */
+    pthread_mutex_t mutex;
+    unsigned long long bytesFreed;
+    /* Paths that could not be deleted by a worker thread. */
+    Paths failed;
+
+    DeletionStatus() : bytesFreed(0)
+    {
+        pthread_mutex_init(&mutex, 0);
     }
 
-    return true;
+    ~DeletionStatus()
+    {
+        pthread_mutex_destroy(&mutex);
+    }
+};
+
+
+/* Recursively delete an invalidated path. */
+struct DeleteWork : ThreadPool::Work
+{
+    Path path;
+    DeletionStatus & status;
+
+    DeleteWork(const Path & path, DeletionStatus & status)
+        : path(path), status(status) { }
 
- isLive:
-    foreach (PathSet::iterator, i, paths) {
-        state.live.insert(*i);
-        if (state.options.action == GCOptions::gcReturnLive)
-            state.results.paths.insert(*i);
+    void run()
+    {
+        /* The main thread is blocked in ThreadPool::process(), so
+           only the workers themselves can write to stderr. */
+        {
+            MutexLock lock(status.mutex);
+            printMsg(lvlInfo, format("deleting `%1%'") % path);
+        }
+
+        unsigned long long bytesFreed = 0;
+        bool ok = true;
+        try {
+            deletePathQuiet(path, bytesFreed);
+        } catch (Error & e) {
+            /* Probably a permission problem, which
+               deletePathWrapped() can deal with on the main thread.
+               Otherwise it reports the error there. */
+            ok = false;
+        }
+        MutexLock lock(status.mutex);
+        status.bytesFreed += bytesFreed;
+        if (!ok) status.failed.push_back(path);
     }
-    return false;
-}
+};
 
 
 /* Unlink all files in /nix/store/.links that have a link count of 1,
@@ -618,6 +778,24 @@ void LocalStore::removeUnusedLinks(const GCState & state)
 
     printMsg(lvlInfo, format("note: currently hard linking saves %.2f MiB")
         % ((unsharedSize - actualSize - overhead) / (1024.0 * 1024.0)));
+
+    /* The entries in the reflinks directory are symlinks to the files
+       that identical files share their blocks with.  They don't keep
+       those files alive, so once a file is gone, its symlink can go
+       too. */
+    if (pathExists(reflinksDir)) {
+        Strings names = readDirectory(reflinksDir);
+        foreach (Strings::iterator, i, names) {
+            checkInterrupt();
+            Path path = reflinksDir + "/" + *i;
+            if (stat(path.c_str(), &st) == 0) continue;
+            if (errno != ENOENT)
+                throw SysError(format("statting `%1%'") % path);
+            printMsg(lvlTalkative, format("deleting dangling reflink `%1%'") % path);
+            if (unlink(path.c_str()) == -1 && errno != ENOENT)
+                throw SysError(format("deleting `%1%'") % path);
+        }
+    }
 }
 
 
@@ -668,24 +846,105 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
        increase, since we hold locks on everything.  So everything
        that is not reachable from `roots'. */
 
+    /* Translate a free space target into a number of bytes to
+       free. */
+    if (options.minFree != 0 && options.action != GCOptions::gcDeleteSpecific) {
+        struct statvfs st;
+        if (statvfs(settings.nixStore.c_str(), &st) == -1)
+            throw SysError(format("getting free space on `%1%'") % settings.nixStore);
+        unsigned long long avail = (unsigned long long) st.f_bavail * st.f_frsize;
+        unsigned long long needed = avail >= options.minFree ? 0 : options.minFree - avail;
+        printMsg(lvlInfo, format("%1% bytes available, need to free %2% bytes") % avail % needed);
+        state.options.maxFreed = std::min(state.options.maxFreed, needed);
+    }
+
+    /* Load the reference graph of the valid paths and mark those
+       that are reachable from the roots.  This is a consistent
+       snapshot: any path registered from now on is a temporary root
+       of some process, and so are its references. */
+    if (options.action == GCOptions::gcDeleteSpecific || state.options.maxFreed > 0) {
+
+        queryPathGraph(state.graph);
+
+        size_t nrNodes = state.graph.paths.size();
+        for (unsigned int n = 0; n < nrNodes; ++n)
+            state.nodes[state.graph.paths[n]] = n;
+
+        state.references.build(nrNodes, state.graph.references, false);
+        state.referrers.build(nrNodes, state.graph.references, true);
+        state.outputs.build(nrNodes, state.graph.outputs, false);
+        state.derivers.build(nrNodes, state.graph.outputs, true);
+
+        state.keepsAlive.push_back(&state.references);
+        state.keptAliveBy.push_back(&state.referrers);
+        if (state.gcKeepOutputs) {
+            state.keepsAlive.push_back(&state.outputs);
+            state.keptAliveBy.push_back(&state.derivers);
+        }
+        if (state.gcKeepDerivations) {
+            state.keepsAlive.push_back(&state.derivers);
+            state.keptAliveBy.push_back(&state.outputs);
+        }
+
+        std::vector<unsigned int> rootNodes;
+        foreach (PathSet::iterator, i, state.roots) {
+            std::map<Path, unsigned int>::iterator j = state.nodes.find(*i);
+            if (j != state.nodes.end()) rootNodes.push_back(j->second);
+        }
+
+        state.live.assign(nrNodes, false);
+        markReachable(rootNodes, state.keepsAlive, state.live);
+    }
+
     /* Now either delete all garbage paths, or just the specified
        paths (for gcDeleteSpecific). */
 
     if (options.action == GCOptions::gcDeleteSpecific) {
 
-        foreach (PathSet::iterator, i, options.pathsToDelete) {
-            assertStorePath(*i);
-            if (!tryToDelete(state, *i))
-                throw Error(format("cannot delete path `%1%' since it is still alive") % *i);
+        try {
+
+            /* Deleting a path requires deleting everything that keeps
+               it alive.  Since the path is dead, so are those. */
+            std::vector<unsigned int> todo;
+            foreach (PathSet::iterator, i, options.pathsToDelete) {
+                assertStorePath(*i);
+                std::map<Path, unsigned int>::iterator j = state.nodes.find(*i);
+                if (j != state.nodes.end()) {
+                    if (state.live[j->second])
+                        throw Error(format("cannot delete path `%1%' since it is still alive") % *i);
+                    todo.push_back(j->second);
+                } else if (pathExists(*i)) {
+                    if (!canDeleteInvalid(state, *i))
+                        throw Error(format("cannot delete path `%1%' since it is still alive") % *i);
+                    deleteInvalidPath(state, *i);
+                }
+            }
+
+            std::vector<bool> doomed(state.graph.paths.size(), false);
+            markReachable(todo, state.keptAliveBy, doomed);
+
+            std::vector<unsigned int> nodes;
+            for (unsigned int n = 0; n < doomed.size(); ++n)
+                if (doomed[n]) nodes.push_back(n);
+
+            std::vector<unsigned int> sorted = sortForDeletion(nodes, state.referrers);
+            foreach (std::vector<unsigned int>::iterator, i, sorted)
+                deleteValidPath(state, *i);
+
+        } catch (GCLimitReached & e) {
         }
 
-    } else if (options.maxFreed > 0) {
+    } else if (state.options.maxFreed > 0) {
 
         if (shouldDelete(state.options.action))
             printMsg(lvlError, format("deleting garbage..."));
         else
             printMsg(lvlError, format("determining live/dead paths..."));
 
+        if (options.action == GCOptions::gcReturnLive)
+            for (unsigned int n = 0; n < state.live.size(); ++n)
+                if (state.live[n]) results.paths.insert(state.graph.paths[n]);
+
         try {
 
             AutoCloseDir dir = opendir(settings.nixStore.c_str());
@@ -697,31 +956,35 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
                paths, since unreachable paths could become reachable
                again.  We don't use readDirectory() here so that GCing
                can start faster. */
-            Paths entries;
             struct dirent * dirent;
             while (errno = 0, dirent = readdir(dir)) {
                 checkInterrupt();
                 string name = dirent->d_name;
                 if (name == "." || name == "..") continue;
                 Path path = settings.nixStore + "/" + name;
-                if (isValidPath(path))
-                    entries.push_back(path);
-                else
-                    tryToDelete(state, path);
+                if (path == linksDir || path == reflinksDir || state.nodes.find(path) != state.nodes.end()) continue;
+                if (canDeleteInvalid(state, path))
+                    deleteInvalidPath(state, path);
+                else if (options.action == GCOptions::gcReturnLive)
+                    results.paths.insert(path);
             }
 
             dir.close();
 
-            /* Now delete the unreachable valid paths.  Randomise the
-               order in which we delete entries to make the collector
-               less biased towards deleting paths that come
-               alphabetically first (e.g. /nix/store/000...).  This
-               matters when using --max-freed etc. */
-            vector<Path> entries_(entries.begin(), entries.end());
-            random_shuffle(entries_.begin(), entries_.end());
-
-            foreach (vector<Path>::iterator, i, entries_)
-                tryToDelete(state, *i);
+            /* Now delete the unreachable valid paths.  The order
+               matters when using --max-freed etc.  A path's referrers
+               are deleted right before it, regardless of their own
+               position in the order. */
+            if (options.action != GCOptions::gcReturnLive) {
+                std::vector<unsigned int> dead;
+                for (unsigned int n = 0; n < state.live.size(); ++n)
+                    if (!state.live[n]) dead.push_back(n);
+                state.orderDead(dead);
+
+                std::vector<unsigned int> sorted = sortForDeletion(dead, state.referrers);
+                foreach (std::vector<unsigned int>::iterator, i, sorted)
+                    deleteValidPath(state, *i);
+            }
 
         } catch (GCLimitReached & e) {
         }
@@ -731,9 +994,28 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
     fdGCLock.close();
 
     /* Delete the invalidated paths now that the lock has been
-       released. */
-    foreach (PathSet::iterator, i, state.invalidated)
-        deleteGarbage(state, *i);
+       released.  This is dominated by I/O latency, so it's done by a
+       pool of threads, unless there is only one path or thread. */
+    if (settings.gcDeleteThreads == 1 || state.invalidated.size() == 1)
+        foreach (PathSet::iterator, i, state.invalidated)
+            deleteGarbage(state, *i);
+
+    else if (!state.invalidated.empty()) {
+        DeletionStatus status;
+        {
+            ThreadPool pool(settings.gcDeleteThreads);
+            foreach (PathSet::iterator, i, state.invalidated)
+                pool.enqueue(new DeleteWork(*i, status));
+            pool.process();
+        }
+        state.results.bytesFreed += status.bytesFreed;
+        /* The workers have already announced these paths. */
+        foreach (Paths::iterator, i, status.failed) {
+            unsigned long long bytesFreed;
+            deletePathWrapped(*i, bytesFreed);
+            state.results.bytesFreed += bytesFreed;
+        }
+    }
 
     /* Clean up the links directory. */
     if (options.action == GCOptions::gcDeleteDead || options.action == GCOptions::gcDeleteSpecific) {
@@ -2,10 +2,15 @@
 
 #include "globals.hh"
 #include "util.hh"
+#include "archive.hh"
+#include "tree-walk.hh"
 
 #include <map>
 #include <algorithm>
 
+#include <glob.h>
+#include <sys/stat.h>
+
 
 namespace nix {
 
@@ -20,7 +25,9 @@ Settings::Settings()
     tryFallback = false;
     buildVerbosity = lvlError;
     maxBuildJobs = 1;
+    maxSubstitutionJobs = 0;
     buildCores = 1;
+    dynamicBuildCores = false;
     readOnlyMode = false;
     thisSystem = SYSTEM;
     maxSilentTime = 0;
@@ -43,8 +50,14 @@ Settings::Settings()
     checkRootReachability = false;
     gcKeepOutputs = false;
     gcKeepDerivations = true;
+    gcDeleteThreads = 0;
     autoOptimiseStore = false;
     envKeepDerivations = false;
+    pathInfoCacheSize = 0;
+    verifyThreads = 0;
+    verifyMaxRate = 0;
+    optimiseThreads = 0;
+    optimiseMethod = "hardlink";
 }
 
 
@@ -64,6 +77,7 @@ void Settings::processEnvironment()
         if (getEnv("NIX_OTHER_STORES") != "")
             substituters.push_back(nixLibexecDir + "/nix/substituters/copy-from-other-stores.pl");
         substituters.push_back(nixLibexecDir + "/nix/substituters/download-using-manifests.pl");
+        substituters.push_back(builtinBinaryCache);
         substituters.push_back(nixLibexecDir + "/nix/substituters/download-from-binary-cache.pl");
     } else
         substituters = tokenizeString<Strings>(subs, ":");
@@ -114,7 +128,9 @@ void Settings::update()
 {
     get(tryFallback, "build-fallback");
     get(maxBuildJobs, "build-max-jobs");
+    get(maxSubstitutionJobs, "build-max-substitution-jobs");
     get(buildCores, "build-cores");
+    get(dynamicBuildCores, "build-dynamic-cores");
     get(thisSystem, "system");
     get(maxSilentTime, "build-max-silent-time");
     get(buildTimeout, "build-timeout");
@@ -134,8 +150,17 @@ void Settings::update()
     get(checkRootReachability, "gc-check-reachability");
     get(gcKeepOutputs, "gc-keep-outputs");
     get(gcKeepDerivations, "gc-keep-derivations");
+    get(gcDeleteThreads, "gc-delete-threads");
     get(autoOptimiseStore, "auto-optimise-store");
     get(envKeepDerivations, "env-keep-derivations");
+    get(pathInfoCacheSize, "path-info-cache-size");
+    get(verifyThreads, "verify-threads");
+    get(verifyMaxRate, "verify-max-rate");
+    get(optimiseThreads, "optimise-threads");
+    get(optimiseMethod, "optimise-method");
+    get(dumpReadAheadThreads, "dump-read-ahead-threads");
+    get(restoreThreads, "restore-threads");
+    get(walkThreads, "tree-walk-threads");
 }
 
 
@@ -197,7 +222,73 @@ Settings::SettingsMap Settings::getOverrides()
 }
 
 
+static Strings cacheURLs(const string & s)
+{
+    Strings urls = tokenizeString<Strings>(s);
+    foreach (Strings::iterator, i, urls) {
+        string::size_type n = i->find_last_not_of('/');
+        i->erase(n == string::npos ? 0 : n + 1);
+    }
+    return urls;
+}
+
+
+Strings Settings::getBinaryCaches()
+{
+    Strings res;
+
+    bool use = true, untrustedUse = true;
+    get(use, "use-binary-caches");
+    get(untrustedUse, "untrusted-use-binary-caches");
+    if (!use || !untrustedUse) return res;
+
+    string s;
+    get(s, "binary-caches");
+    Strings urls = cacheURLs(s);
+
+    /* Each file matching `binary-cache-files' contains a URL on its
+       first line. */
+    string files = "/nix/var/nix/profiles/per-user/root/channels/binary-caches/*";
+    get(files, "binary-cache-files");
+    glob_t gl;
+    if (glob(files.c_str(), 0, 0, &gl) == 0) {
+        for (size_t n = 0; n < gl.gl_pathc; ++n) {
+            struct stat st;
+            if (stat(gl.gl_pathv[n], &st) == -1 || !S_ISREG(st.st_mode)) continue;
+            string url = readFile(gl.gl_pathv[n]);
+            url = string(url, 0, url.find('\n'));
+            Strings more = cacheURLs(url);
+            urls.insert(urls.end(), more.begin(), more.end());
+        }
+        globfree(&gl);
+    }
+
+    /* Clients of the daemon may select a subset of the binary caches
+       and of `trusted-binary-caches'. */
+    SettingsMap::iterator i = settings.find("untrusted-binary-caches");
+    if (i != settings.end()) {
+        string t;
+        get(t, "trusted-binary-caches");
+        Strings trusted = cacheURLs(t);
+        trusted.insert(trusted.end(), urls.begin(), urls.end());
+        urls = cacheURLs(i->second);
+        foreach (Strings::iterator, j, urls)
+            if (find(trusted.begin(), trusted.end(), *j) == trusted.end())
+                throw Error(format("binary cache `%1%' is not trusted (please add it to `trusted-binary-caches' in %2%/nix.conf)")
+                    % *j % nixConfDir);
+    }
+
+    StringSet seen;
+    foreach (Strings::iterator, j, urls)
+        if (seen.insert(*j).second) res.push_back(*j);
+
+    return res;
+}
+
+
 const string nixVersion = NIX_VERSION;
 
+const string builtinBinaryCache = "builtin-binary-cache";
+
 
 }
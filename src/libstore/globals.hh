@@ -27,6 +27,13 @@ struct Settings {
 
     SettingsMap getOverrides();
 
+    /* Return the URLs of the binary caches to use, as
+       download-from-binary-cache.pl determines them from
+       `binary-caches', `use-binary-caches' and, for clients of the
+       daemon, their `untrusted-' variants, and from the files
+       matching `binary-cache-files'. */
+    Strings getBinaryCaches();
+
     /* The directory where we store sources and derived files. */
     Path nixStore;
 
@@ -68,12 +75,23 @@ struct Settings {
     /* Maximum number of parallel build jobs.  0 means unlimited. */
     unsigned int maxBuildJobs;
 
+    /* Maximum number of parallel substitutions.  0 means that
+       substitutions take build slots, counting towards
+       `maxBuildJobs'. */
+    unsigned int maxSubstitutionJobs;
+
     /* Number of CPU cores to utilize in parallel within a build,
        i.e. by passing this number to Make via '-j'. 0 means that the
        number of actual CPU cores on the local host ought to be
        auto-detected. */
     unsigned int buildCores;
 
+    /* Whether to choose the number of cores for each build when it
+       starts, based on the number of builds and the system load (with
+       `buildCores' as the maximum), and to give each builder a GNU Make
+       jobserver. */
+    bool dynamicBuildCores;
+
     /* Read-only mode.  Don't copy stuff to the store, don't change
        the database. */
     bool readOnlyMode;
@@ -92,7 +110,9 @@ struct Settings {
 
     /* The substituters.  There are programs that can somehow realise
        a store path without building, e.g., by downloading it or
-       copying it from a CD. */
+       copying it from a CD.  The name `builtinBinaryCache' denotes
+       the substituter built into Nix that reads binary caches in
+       local directories (`file://' URLs). */
     Paths substituters;
 
     /* Whether to use build hooks (for distributed builds).  Sometimes
@@ -168,6 +188,11 @@ struct Settings {
        paths. */
     bool gcKeepDerivations;
 
+    /* The number of threads used by the garbage collector to delete
+       paths after releasing the GC lock.  0 means one per CPU
+       core. */
+    unsigned int gcDeleteThreads;
+
     /* Whether to automatically replace files with identical contents
        with hard links. */
     bool autoOptimiseStore;
@@ -176,6 +201,30 @@ struct Settings {
        (to prevent them from being GCed). */
     bool envKeepDerivations;
 
+    /* Maximum number of valid paths whose info (including their
+       references) is cached in memory by each Nix process.  0
+       disables the cache. */
+    unsigned int pathInfoCacheSize;
+
+    /* The number of threads used by `nix-store --verify
+       --check-contents' to hash store paths.  0 means one per CPU
+       core. */
+    unsigned int verifyThreads;
+
+    /* The maximum number of bytes per second that `nix-store --verify
+       --check-contents' reads.  0 means no limit. */
+    unsigned long long verifyMaxRate;
+
+    /* The number of threads used by `nix-store --optimise' to hash
+       files.  0 means one per CPU core. */
+    unsigned int optimiseThreads;
+
+    /* How `nix-store --optimise' and `auto-optimise-store' share
+       identical files: `hardlink' replaces them by hard links to a
+       single copy, `reflink' asks the file system to share their
+       blocks (btrfs, XFS), leaving the files themselves alone. */
+    string optimiseMethod;
+
 private:
     SettingsMap settings, overrides;
 
@@ -192,5 +241,7 @@ extern Settings settings;
 
 extern const string nixVersion;
 
+extern const string builtinBinaryCache;
+
 
 }
@@ -6,6 +6,8 @@
 #include "worker-protocol.hh"
 #include "derivations.hh"
 #include "immutable.hh"
+#include "thread-pool.hh"
+#include "tree-walk.hh"
 
 #include <iostream>
 #include <algorithm>
@@ -202,7 +204,7 @@ void checkStoreNotSymlink()
 
 
 LocalStore::LocalStore(bool reserveSpace)
-    : didSetSubstituterEnv(false)
+    : pathInfoDataVersion(-1), didSetSubstituterEnv(false)
 {
     schemaPath = settings.nixDBPath + "/schema";
 
@@ -215,6 +217,7 @@ LocalStore::LocalStore(bool reserveSpace)
     createDirs(settings.nixStore);
     makeStoreWritable();
     createDirs(linksDir = settings.nixStore + "/.links");
+    reflinksDir = settings.nixStore + "/.reflinks";
     Path profilesDir = settings.nixStateDir + "/profiles";
     createDirs(settings.nixStateDir + "/profiles");
     createDirs(settings.nixStateDir + "/temproots");
@@ -373,14 +376,17 @@ void LocalStore::openDB(bool create)
     if (mode == "wal" && sqlite3_exec(db, "pragma wal_autocheckpoint = 8192;", 0, 0, 0) != SQLITE_OK)
         throwSQLiteError(db, "setting autocheckpoint interval");
 
-    /* Initialise the database schema, if necessary. */
-    if (create) {
-        const char * schema =
+    /* Initialise the database schema, if necessary.  This is done
+       on every open, not just when creating the database: the schema
+       only uses `create ... if not exists', and the optional tables
+       (VerifiedPaths, OptimisedPaths, BuildTimes) are added this way
+       to existing databases without changing the schema version, so
+       that older versions of Nix can still open them. */
+    const char * schema =
 #include "schema.sql.hh"
-            ;
-        if (sqlite3_exec(db, (const char *) schema, 0, 0, 0) != SQLITE_OK)
-            throwSQLiteError(db, "initialising database schema");
-    }
+        ;
+    if (sqlite3_exec(db, (const char *) schema, 0, 0, 0) != SQLITE_OK)
+        throwSQLiteError(db, "initialising database schema");
 
     /* Prepare SQL statements. */
     stmtRegisterValidPath.create(db,
@@ -417,6 +423,27 @@ void LocalStore::openDB(bool create)
     // ensure efficient lookup.
     stmtQueryPathFromHashPart.create(db,
         "select path from ValidPaths where path >= ? limit 1;");
+    stmtRegisterBuildTime.create(db,
+        "insert or replace into BuildTimes (name, system, duration, outputSize, buildCores, time) values (?, ?, ?, ?, ?, ?);");
+    stmtQueryBuildTime.create(db,
+        "select duration, outputSize, buildCores from BuildTimes where name = ? and system = ?;");
+    stmtQueryDataVersion.create(db, "pragma data_version;");
+
+    /* queryClosure() builds closures in a temporary table.  Each step
+       adds the paths that are directly reachable from the paths added
+       by the previous one (generation `gen'). */
+    if (sqlite3_exec(db, "create temp table if not exists Closure (id integer primary key not null, gen integer not null);"
+            "create index if not exists temp.IndexClosureGen on Closure(gen);", 0, 0, 0) != SQLITE_OK)
+        throwSQLiteError(db, "creating temporary closure table");
+    stmtClosureClear.create(db, "delete from Closure;");
+    stmtClosureInsert.create(db, "insert or ignore into Closure(id, gen) values (?, 0);");
+    stmtClosureReferences.create(db,
+        "insert or ignore into Closure(id, gen) select r.reference, c.gen + 1 from Closure c join Refs r on r.referrer = c.id where c.gen = ?;");
+    stmtClosureReferrers.create(db,
+        "insert or ignore into Closure(id, gen) select r.referrer, c.gen + 1 from Closure c join Refs r on r.reference = c.id where c.gen = ?;");
+    stmtClosureOutputs.create(db,
+        "insert or ignore into Closure(id, gen) select v.id, c.gen + 1 from Closure c join DerivationOutputs d on d.drv = c.id join ValidPaths v on v.path = d.path where c.gen = ?;");
+    stmtClosureResult.create(db, "select path from ValidPaths where id in (select id from Closure);");
 }
 
 
@@ -455,14 +482,10 @@ void LocalStore::makeStoreWritable()
 const time_t mtimeStore = 1; /* 1 second into the epoch */
 
 
-void canonicalisePathMetaData(const Path & path, bool recurse)
+/* Canonicalise a single entry; `st' is its lstat() information.  This
+   is called from several threads by canonicalisePathMetaData(). */
+static void canonicaliseEntry(const Path & path, const struct stat & st)
 {
-    checkInterrupt();
-
-    struct stat st;
-    if (lstat(path.c_str(), &st))
-        throw SysError(format("getting attributes of path `%1%'") % path);
-
     /* Really make sure that the path is of a supported type.  This
        has already been checked in dumpPath(). */
     assert(S_ISREG(st.st_mode) || S_ISDIR(st.st_mode) || S_ISLNK(st.st_mode));
@@ -515,12 +538,35 @@ void canonicalisePathMetaData(const Path & path, bool recurse)
 #endif
             throw SysError(format("changing modification time of `%1%'") % path);
     }
+}
+
+
+/* Directories are canonicalised before their entries are read, so
+   that unreadable ones can still be walked. */
+struct CanonicaliseVisitor : TreeVisitor
+{
+    bool visit(int dirFd, const string & name, const Path & path, const struct stat & st)
+    {
+        canonicaliseEntry(path, st);
+        return true;
+    }
+};
+
+
+void canonicalisePathMetaData(const Path & path, bool recurse)
+{
+    checkInterrupt();
 
-    if (recurse && S_ISDIR(st.st_mode)) {
-        Strings names = readDirectory(path);
-        foreach (Strings::iterator, i, names)
-            canonicalisePathMetaData(path + "/" + *i, true);
+    if (recurse) {
+        CanonicaliseVisitor visitor;
+        walkTree(path, visitor);
+        return;
     }
+
+    struct stat st;
+    if (lstat(path.c_str(), &st))
+        throw SysError(format("getting attributes of path `%1%'") % path);
+    canonicaliseEntry(path, st);
 }
 
 
@@ -708,13 +754,76 @@ Hash parseHashField(const Path & path, const string & s)
 }
 
 
+/* Return whether the path info cache can be used.  `pragma
+   data_version' changes whenever another process commits a change to
+   the database, so in that case we drop the whole cache.  Changes
+   made by this process uncache the affected paths themselves.  SQLite
+   versions before 3.8.8 don't have `data_version', and then the cache
+   is not used. */
+bool LocalStore::checkPathInfoCache()
+{
+    if (settings.pathInfoCacheSize == 0) return false;
+
+    SQLiteStmtUse use(stmtQueryDataVersion);
+    int r = sqlite3_step(stmtQueryDataVersion);
+    if (r == SQLITE_DONE) return false;
+    if (r != SQLITE_ROW) throwSQLiteError(db, "querying the database version");
+
+    long long version = sqlite3_column_int64(stmtQueryDataVersion, 0);
+    if (version != pathInfoDataVersion) {
+        pathInfoCache.clear();
+        pathInfoLRU.clear();
+        pathInfoDataVersion = version;
+    }
+
+    return true;
+}
+
+
+bool LocalStore::lookupPathInfo(const Path & path, ValidPathInfo & info)
+{
+    PathInfoCache::iterator i = pathInfoCache.find(path);
+    if (i == pathInfoCache.end()) return false;
+    pathInfoLRU.splice(pathInfoLRU.end(), pathInfoLRU, i->second.lru);
+    info = i->second.info;
+    return true;
+}
+
+
+void LocalStore::cachePathInfo(const ValidPathInfo & info)
+{
+    if (settings.pathInfoCacheSize == 0) return;
+    uncachePathInfo(info.path);
+    while (pathInfoCache.size() >= settings.pathInfoCacheSize) {
+        pathInfoCache.erase(pathInfoLRU.front());
+        pathInfoLRU.pop_front();
+    }
+    CachedPathInfo & c(pathInfoCache[info.path]);
+    c.info = info;
+    c.lru = pathInfoLRU.insert(pathInfoLRU.end(), info.path);
+}
+
+
+void LocalStore::uncachePathInfo(const Path & path)
+{
+    PathInfoCache::iterator i = pathInfoCache.find(path);
+    if (i == pathInfoCache.end()) return;
+    pathInfoLRU.erase(i->second.lru);
+    pathInfoCache.erase(i);
+}
+
+
 ValidPathInfo LocalStore::queryPathInfo(const Path & path)
 {
     ValidPathInfo info;
-    info.path = path;
 
     assertStorePath(path);
 
+    bool useCache = checkPathInfoCache();
+    if (useCache && lookupPathInfo(path, info)) return info;
+
+    info.path = path;
+
     /* Get the path info. */
     SQLiteStmtUse use1(stmtQueryPathInfo);
 
@@ -752,6 +861,8 @@ ValidPathInfo LocalStore::queryPathInfo(const Path & path)
     if (r != SQLITE_DONE)
         throwSQLiteError(db, format("error getting references of `%1%'") % path);
 
+    if (useCache) cachePathInfo(info);
+
     return info;
 }
 
@@ -760,6 +871,7 @@ ValidPathInfo LocalStore::queryPathInfo(const Path & path)
    narSize field. */
 void LocalStore::updatePathInfo(const ValidPathInfo & info)
 {
+    uncachePathInfo(info.path);
     SQLiteStmtUse use(stmtUpdatePathInfo);
     if (info.narSize != 0)
         stmtUpdatePathInfo.bind64(info.narSize);
@@ -774,6 +886,8 @@ void LocalStore::updatePathInfo(const ValidPathInfo & info)
 
 unsigned long long LocalStore::queryValidPathId(const Path & path)
 {
+    ValidPathInfo info;
+    if (checkPathInfoCache() && lookupPathInfo(path, info)) return info.id;
     SQLiteStmtUse use(stmtQueryPathInfo);
     stmtQueryPathInfo.bind(path);
     int res = sqlite3_step(stmtQueryPathInfo);
@@ -785,6 +899,8 @@ unsigned long long LocalStore::queryValidPathId(const Path & path)
 
 bool LocalStore::isValidPath(const Path & path)
 {
+    ValidPathInfo info;
+    if (checkPathInfoCache() && lookupPathInfo(path, info)) return true;
     SQLiteStmtUse use(stmtQueryPathInfo);
     stmtQueryPathInfo.bind(path);
     int res = sqlite3_step(stmtQueryPathInfo);
@@ -852,6 +968,84 @@ void LocalStore::queryReferrers(const Path & path, PathSet & referrers)
 }
 
 
+void LocalStore::queryClosure(const PathSet & paths, PathSet & closure,
+    bool flipDirection, bool includeOutputs)
+{
+    PathSet todo;
+    foreach (PathSet::const_iterator, i, paths)
+        if (closure.find(*i) == closure.end()) todo.insert(*i);
+    if (todo.empty()) return;
+
+    SQLiteStmt & stmtStep(flipDirection ? stmtClosureReferrers : stmtClosureReferences);
+
+    while (1) {
+        try {
+            SQLiteTxn txn(db);
+
+            {
+                SQLiteStmtUse use(stmtClosureClear);
+                if (sqlite3_step(stmtClosureClear) != SQLITE_DONE)
+                    throwSQLiteError(db, "clearing temporary closure table");
+            }
+
+            PathSet invalid;
+            foreach (PathSet::iterator, i, todo) {
+                /* As in the default implementation, an invalid path
+                   has no referrers but is its own referrers closure. */
+                if (flipDirection && !isValidPath(*i)) {
+                    invalid.insert(*i);
+                    continue;
+                }
+                unsigned long long id = queryValidPathId(*i);
+                SQLiteStmtUse use(stmtClosureInsert);
+                stmtClosureInsert.bind64(id);
+                if (sqlite3_step(stmtClosureInsert) != SQLITE_DONE)
+                    throwSQLiteError(db, "adding path to closure");
+            }
+
+            for (int gen = 0; ; ++gen) {
+                int added = 0;
+
+                SQLiteStmtUse use(stmtStep);
+                stmtStep.bind(gen);
+                if (sqlite3_step(stmtStep) != SQLITE_DONE)
+                    throwSQLiteError(db, "computing closure");
+                added += sqlite3_changes(db);
+
+                if (includeOutputs) {
+                    SQLiteStmtUse use(stmtClosureOutputs);
+                    stmtClosureOutputs.bind(gen);
+                    if (sqlite3_step(stmtClosureOutputs) != SQLITE_DONE)
+                        throwSQLiteError(db, "computing closure");
+                    added += sqlite3_changes(db);
+                }
+
+                if (added == 0) break;
+            }
+
+            PathSet res(invalid);
+            SQLiteStmtUse use(stmtClosureResult);
+            int r;
+            while ((r = sqlite3_step(stmtClosureResult)) == SQLITE_ROW) {
+                const char * s = (const char *) sqlite3_column_text(stmtClosureResult, 0);
+                assert(s);
+                res.insert(s);
+            }
+            if (r != SQLITE_DONE)
+                throwSQLiteError(db, "getting closure");
+
+            closure.insert(res.begin(), res.end());
+
+            txn.commit();
+            break;
+        } catch (SQLiteBusy & e) {
+            /* Retry; the `txn' destructor will roll back the current
+               transaction. */
+        }
+    }
+}
+
+
 Path LocalStore::queryDeriver(const Path & path)
 {
     return queryPathInfo(path).deriver;
@@ -880,6 +1074,73 @@ PathSet LocalStore::queryValidDerivers(const Path & path)
 }
 
 
+/* Map a database id to its index in the sorted vector `ids'. */
+static bool lookupNode(const std::vector<unsigned long long> & ids,
+    unsigned long long id, unsigned int & node)
+{
+    std::vector<unsigned long long>::const_iterator i =
+        std::lower_bound(ids.begin(), ids.end(), id);
+    if (i == ids.end() || *i != id) return false;
+    node = i - ids.begin();
+    return true;
+}
+
+
+void LocalStore::queryPathGraph(PathGraph & graph)
+{
+    while (1) {
+        try {
+            SQLiteTxn txn(db);
+
+            graph = PathGraph();
+            std::vector<unsigned long long> ids;
+
+            SQLiteStmt stmtPaths;
+            stmtPaths.create(db, "select id, path, narSize, registrationTime from ValidPaths order by id;");
+            int r;
+            while ((r = sqlite3_step(stmtPaths)) == SQLITE_ROW) {
+                ids.push_back(sqlite3_column_int64(stmtPaths, 0));
+                const char * s = (const char *) sqlite3_column_text(stmtPaths, 1);
+                assert(s);
+                graph.paths.push_back(s);
+                graph.narSizes.push_back(sqlite3_column_int64(stmtPaths, 2));
+                graph.registrationTimes.push_back(sqlite3_column_int64(stmtPaths, 3));
+            }
+            if (r != SQLITE_DONE)
+                throwSQLiteError(db, "error getting valid paths");
+
+            SQLiteStmt stmtRefs;
+            stmtRefs.create(db, "select referrer, reference from Refs;");
+            while ((r = sqlite3_step(stmtRefs)) == SQLITE_ROW) {
+                unsigned int from, to;
+                if (lookupNode(ids, sqlite3_column_int64(stmtRefs, 0), from) &&
+                    lookupNode(ids, sqlite3_column_int64(stmtRefs, 1), to))
+                    graph.references.push_back(std::make_pair(from, to));
+            }
+            if (r != SQLITE_DONE)
+                throwSQLiteError(db, "error getting references");
+
+            SQLiteStmt stmtOutputs;
+            stmtOutputs.create(db, "select d.drv, v.id from DerivationOutputs d join ValidPaths v on v.path = d.path;");
+            while ((r = sqlite3_step(stmtOutputs)) == SQLITE_ROW) {
+                unsigned int drv, output;
+                if (lookupNode(ids, sqlite3_column_int64(stmtOutputs, 0), drv) &&
+                    lookupNode(ids, sqlite3_column_int64(stmtOutputs, 1), output))
+                    graph.outputs.push_back(std::make_pair(drv, output));
+            }
+            if (r != SQLITE_DONE)
+                throwSQLiteError(db, "error getting derivation outputs");
+
+            txn.commit();
+            break;
+        } catch (SQLiteBusy & e) {
+            /* Retry; the `txn' destructor will roll back the current
+               transaction. */
+        }
+    }
+}
+
+
 PathSet LocalStore::queryDerivationOutputs(const Path & path)
 {
     SQLiteTxn txn(db);
@@ -944,6 +1205,61 @@ Path LocalStore::queryPathFromHashPart(const string & hashPart)
 }
 
 
+/* The name under which builds of a derivation are recorded: its name
+   without the version, i.e. up to the first dash that is followed by
+   something other than a letter (as in DrvName). */
+static string buildTimeName(const Path & drvPath)
+{
+    string name = storePathToName(drvPath);
+    if (isDerivation(name)) name = string(name, 0, name.size() - drvExtension.size());
+    for (string::size_type i = 0; i + 1 < name.size(); ++i)
+        if (name[i] == '-' && !isalpha(name[i + 1])) return string(name, 0, i);
+    return name;
+}
+
+
+bool LocalStore::queryBuildTime(const Path & drvPath, const Derivation & drv, BuildTime & time)
+{
+    SQLiteStmtUse use(stmtQueryBuildTime);
+    stmtQueryBuildTime.bind(buildTimeName(drvPath));
+    stmtQueryBuildTime.bind(drv.platform);
+
+    int res = sqlite3_step(stmtQueryBuildTime);
+    if (res == SQLITE_DONE) return false;
+    if (res != SQLITE_ROW) throwSQLiteError(db, "querying build time");
+
+    time.duration = sqlite3_column_int64(stmtQueryBuildTime, 0);
+    time.outputSize = sqlite3_column_int64(stmtQueryBuildTime, 1);
+    time.buildCores = sqlite3_column_int(stmtQueryBuildTime, 2);
+    return true;
+}
+
+
+void LocalStore::queryBuildTimes(const PathSet & drvPaths, BuildTimes & times)
+{
+    foreach (PathSet::const_iterator, i, drvPaths) {
+        if (!isDerivation(*i) || !isValidPath(*i)) continue;
+        Derivation drv = parseDerivation(readFile(*i));
+        BuildTime time;
+        if (queryBuildTime(*i, drv, time)) times[*i] = time;
+    }
+}
+
+
+void LocalStore::registerBuildTime(const Path & drvPath, const Derivation & drv, const BuildTime & time)
+{
+    SQLiteStmtUse use(stmtRegisterBuildTime);
+    stmtRegisterBuildTime.bind(buildTimeName(drvPath));
+    stmtRegisterBuildTime.bind(drv.platform);
+    stmtRegisterBuildTime.bind64(time.duration);
+    stmtRegisterBuildTime.bind64(time.outputSize);
+    stmtRegisterBuildTime.bind(time.buildCores);
+    stmtRegisterBuildTime.bind(::time(0));
+    if (sqlite3_step(stmtRegisterBuildTime) != SQLITE_DONE)
+        throwSQLiteError(db, format("registering build time of `%1%'") % drvPath);
+}
+
+
 void LocalStore::setSubstituterEnv()
 {
     if (didSetSubstituterEnv) return;
@@ -952,10 +1268,23 @@ void LocalStore::setSubstituterEnv()
        --option) to substituters. */
     setenv("_NIX_OPTIONS", settings.pack().c_str(), 1);
 
+    /* Tell download-from-binary-cache.pl to leave the caches that
+       the builtin substituter reads to it. */
+    if (find(settings.substituters.begin(), settings.substituters.end(),
+            builtinBinaryCache) != settings.substituters.end())
+        setenv("_NIX_BUILTIN_BINARY_CACHES",
+            concatStringsSep(" ", localBinaryCaches.getURLs()).c_str(), 1);
+
     didSetSubstituterEnv = true;
 }
 
 
+string LocalStore::substituteFromBinaryCache(const Path & storePath, const Path & destPath)
+{
+    return localBinaryCaches.substitute(storePath, destPath);
+}
+
+
 void LocalStore::startSubstituter(const Path & substituter, RunningSubstituter & run)
 {
     if (run.pid != -1) return;
@@ -1015,6 +1344,14 @@ PathSet LocalStore::querySubstitutablePaths(const PathSet & paths)
     PathSet res;
     foreach (Paths::iterator, i, settings.substituters) {
         if (res.size() == paths.size()) break;
+        if (*i == builtinBinaryCache) {
+            PathSet left;
+            foreach (PathSet::const_iterator, j, paths)
+                if (res.find(*j) == res.end()) left.insert(*j);
+            PathSet found = localBinaryCaches.querySubstitutablePaths(left);
+            res.insert(found.begin(), found.end());
+            continue;
+        }
         RunningSubstituter & run(runningSubstituters[*i]);
         startSubstituter(*i, run);
         string s = "have ";
@@ -1042,6 +1379,11 @@ PathSet LocalStore::querySubstitutablePaths(const PathSet & paths)
 void LocalStore::querySubstitutablePathInfos(const Path & substituter,
     PathSet & paths, SubstitutablePathInfos & infos)
 {
+    if (substituter == builtinBinaryCache) {
+        localBinaryCaches.querySubstitutablePathInfos(paths, infos);
+        return;
+    }
+
     RunningSubstituter & run(runningSubstituters[substituter]);
     startSubstituter(substituter, run);
 
@@ -1136,7 +1478,14 @@ void LocalStore::registerValidPaths(const ValidPathInfos & infos)
             break;
         } catch (SQLiteBusy & e) {
             /* Retry; the `txn' destructor will roll back the current
-               transaction. */
+               transaction.  Info cached by queries inside it is
+               stale. */
+            foreach (ValidPathInfos::const_iterator, i, infos)
+                uncachePathInfo(i->path);
+        } catch (...) {
+            foreach (ValidPathInfos::const_iterator, i, infos)
+                uncachePathInfo(i->path);
+            throw;
         }
     }
 }
@@ -1149,6 +1498,7 @@ void LocalStore::invalidatePath(const Path & path)
     debug(format("invalidating path `%1%'") % path);
 
     drvHashes.erase(path);
+    uncachePathInfo(path);
 
     SQLiteStmtUse use(stmtInvalidatePath);
 
@@ -1162,13 +1512,9 @@ void LocalStore::invalidatePath(const Path & path)
 }
 
 
-Path LocalStore::addToStoreFromDump(const string & dump, const string & name,
-    bool recursive, HashType hashAlgo, bool repair)
+Path LocalStore::addTempPathToStore(const Path & tmpPath, const Path & dstPath,
+    const HashResult & narHash, bool repair, FileHashSink * fileHashes)
 {
-    Hash h = hashString(hashAlgo, dump);
-
-    Path dstPath = makeFixedOutputPath(recursive, hashAlgo, h, name);
-
     addTempRoot(dstPath);
 
     if (repair || !isValidPath(dstPath)) {
@@ -1182,26 +1528,23 @@ Path LocalStore::addToStoreFromDump(const string & dump, const string & name,
 
             if (pathExists(dstPath)) deletePathWrapped(dstPath);
 
-            if (recursive) {
-                StringSource source(dump);
-                restorePath(dstPath, source);
-            } else
-                writeFile(dstPath, dump);
+            if (rename(tmpPath.c_str(), dstPath.c_str()) == -1)
+                throw SysError(format("cannot move `%1%' to `%2%'")
+                    % tmpPath % dstPath);
 
             canonicalisePathMetaData(dstPath);
 
             /* Register the SHA-256 hash of the NAR serialisation of
-               the path in the database.  We may just have computed it
-               above (if called with recursive == true and hashAlgo ==
-               sha256); otherwise, compute it here. */
-            HashResult hash;
-            if (recursive) {
-                hash.first = hashAlgo == htSHA256 ? h : hashString(htSHA256, dump);
-                hash.second = dump.size();
-            } else
-                hash = hashPath(htSHA256, dstPath);
-
-            optimisePath(dstPath); // FIXME: combine with hashPath()
+               the path in the database.  The caller may already have
+               computed it (and then hopefully the file hashes as
+               well); otherwise, compute it here. */
+            HashResult hash = narHash;
+            if (hash.first.type != htSHA256)
+                hash = hashAndOptimisePath(dstPath);
+            else if (fileHashes)
+                optimisePath(dstPath, *fileHashes);
+            else
+                optimisePath(dstPath);
 
             ValidPathInfo info;
             info.path = dstPath;
@@ -1217,22 +1560,184 @@ Path LocalStore::addToStoreFromDump(const string & dump, const string & name,
 }
 
 
+/* A sink that feeds data to a SHA-256 hash and, if a different hash
+   type was requested, to a second hash as well. */
+struct DualHashSink : Sink
+{
+    HashType ht;
+    HashSink narHashSink, hashSink;
+    DualHashSink(HashType ht) : ht(ht), narHashSink(htSHA256), hashSink(ht) { }
+    void operator () (const unsigned char * data, size_t len)
+    {
+        narHashSink(data, len);
+        if (ht != htSHA256) hashSink(data, len);
+    }
+    void finish(Hash & hash, HashResult & narHash)
+    {
+        narHash = narHashSink.finish();
+        hash = ht == htSHA256 ? narHash.first : hashSink.finish().first;
+    }
+};
+
+
+/* Adapter class of a Source that passes all data read to a Sink. */
+struct TeeSource : Source
+{
+    Source & orig;
+    Sink & sink;
+    TeeSource(Source & orig, Sink & sink) : orig(orig), sink(sink) { }
+    size_t read(unsigned char * data, size_t len)
+    {
+        size_t n = orig.read(data, len);
+        sink(data, n);
+        return n;
+    }
+};
+
+
+/* Parse a NAR containing a single regular file, writing the file's
+   contents to `dstPath' and hashing them.  If the NAR contains
+   anything else, the rest of it is skipped and `regular' is set to
+   false. */
+struct RestoreRegularSink : ParseSink
+{
+    Path dstPath;
+    AutoCloseFD fd;
+    HashSink hashSink;
+    bool regular;
+
+    RestoreRegularSink(const Path & dstPath, HashType ht)
+        : dstPath(dstPath), hashSink(ht), regular(true) { }
+
+    void createDirectory(const Path & path)
+    {
+        regular = false;
+    }
+
+    void createRegularFile(const Path & path)
+    {
+        if (path != "") { regular = false; return; }
+        fd = open(dstPath.c_str(), O_CREAT | O_EXCL | O_WRONLY, 0666);
+        if (fd == -1) throw SysError(format("creating file `%1%'") % dstPath);
+    }
+
+    void receiveContents(unsigned char * data, unsigned int len)
+    {
+        if (!regular) return;
+        writeFull(fd, data, len);
+        hashSink(data, len);
+    }
+
+    void createSymlink(const Path & path, const string & target)
+    {
+        regular = false;
+    }
+};
+
+
+Path LocalStore::addToStoreFromDump(Source & dump, const string & name,
+    bool recursive, HashType hashAlgo, bool repair)
+{
+    /* We don't know the store path until the hash has been computed,
+       so unpack into a temporary directory in the store while
+       reading, then move the result into place. */
+    Path tmpDir = createTempDirInStore();
+    AutoDelete delTmp(tmpDir);
+    Path tmpPath = tmpDir + "/x";
+
+    HashResult narHash;
+    FileHashSink fileHashes(settings.autoOptimiseStore);
+    Path dstPath = unpackDump(dump, tmpPath, name, recursive, hashAlgo, narHash, fileHashes);
+    if (dstPath == "") throw Error("regular file expected");
+
+    return addTempPathToStore(tmpPath, dstPath, narHash, repair, &fileHashes);
+}
+
+
+Path LocalStore::unpackDump(Source & dump, const Path & tmpPath, const string & name,
+    bool recursive, HashType hashAlgo, HashResult & narHash,
+    FileHashSink & fileHashes)
+{
+    Hash h;
+
+    if (recursive) {
+        DualHashSink hashSink(hashAlgo);
+        TeeSource source(dump, hashSink);
+        restorePath(tmpPath, source, fileHashes);
+        hashSink.finish(h, narHash);
+    } else {
+        RestoreRegularSink sink(tmpPath, hashAlgo);
+        parseDump(sink, dump);
+        if (!sink.regular) return "";
+        h = sink.hashSink.finish().first;
+    }
+
+    return makeFixedOutputPath(recursive, hashAlgo, h, name);
+}
+
+
+Path LocalStore::addToStoreFromDump(const string & dump, const string & name,
+    bool recursive, HashType hashAlgo, bool repair)
+{
+    if (recursive) {
+        StringSource source(dump);
+        return addToStoreFromDump(source, name, recursive, hashAlgo, repair);
+    }
+
+    Path tmpDir = createTempDirInStore();
+    AutoDelete delTmp(tmpDir);
+    Path tmpPath = tmpDir + "/x";
+
+    writeFile(tmpPath, dump);
+
+    return addTempPathToStore(tmpPath,
+        makeFixedOutputPath(recursive, hashAlgo, hashString(hashAlgo, dump), name),
+        HashResult(), repair);
+}
+
+
 Path LocalStore::addToStore(const Path & _srcPath,
     bool recursive, HashType hashAlgo, PathFilter & filter, bool repair)
 {
     Path srcPath(absPath(_srcPath));
     debug(format("adding `%1%' to the store") % srcPath);
 
-    /* Read the whole path into memory. This is not a very scalable
-       method for very large paths, but `copyPath' is mainly used for
-       small files. */
-    StringSink sink;
-    if (recursive)
-        dumpPath(srcPath, sink, filter);
-    else
-        sink.s = readFile(srcPath);
+    /* Copy the path into a temporary directory in the store while
+       computing its hash.  This way, neither the archive nor the
+       file contents have to be held in memory. */
+    Path tmpDir = createTempDirInStore();
+    AutoDelete delTmp(tmpDir);
+    Path tmpPath = tmpDir + "/x";
+
+    Hash h;
+    HashResult narHash;
+    FileHashSink fileHashes(settings.autoOptimiseStore);
+
+    if (recursive) {
+        DualHashSink hashSink(hashAlgo);
+        copyPath(srcPath, tmpPath, hashSink, fileHashes, filter);
+        hashSink.finish(h, narHash);
+    } else {
+        AutoCloseFD fdSrc = open(srcPath.c_str(), O_RDONLY);
+        if (fdSrc == -1) throw SysError(format("opening file `%1%'") % srcPath);
+        AutoCloseFD fdDst = open(tmpPath.c_str(), O_CREAT | O_EXCL | O_WRONLY, 0666);
+        if (fdDst == -1) throw SysError(format("creating file `%1%'") % tmpPath);
+
+        HashSink hashSink(hashAlgo);
+        unsigned char buf[65536];
+        ssize_t n;
+        while ((n = read(fdSrc, buf, sizeof(buf)))) {
+            checkInterrupt();
+            if (n == -1) throw SysError(format("reading file `%1%'") % srcPath);
+            writeFull(fdDst, buf, n);
+            hashSink(buf, n);
+        }
+        h = hashSink.finish().first;
+    }
 
-    return addToStoreFromDump(sink.s, baseNameOf(srcPath), recursive, hashAlgo, repair);
+    return addTempPathToStore(tmpPath,
+        makeFixedOutputPath(recursive, hashAlgo, h, baseNameOf(srcPath)), narHash, repair,
+        &fileHashes);
 }
 
 
@@ -1255,9 +1760,7 @@ Path LocalStore::addTextToStore(const string & name, const string & s,
 
             canonicalisePathMetaData(dstPath);
 
-            HashResult hash = hashPath(htSHA256, dstPath);
-
-            optimisePath(dstPath);
+            HashResult hash = hashAndOptimisePath(dstPath);
 
             ValidPathInfo info;
             info.path = dstPath;
@@ -1402,31 +1905,41 @@ Path LocalStore::createTempDirInStore()
 }
 
 
-Path LocalStore::importPath(bool requireSignature, Source & source)
+/* An exported path that has been unpacked into a temporary directory
+   but not yet moved into the store. */
+struct ImportedPath
+{
+    Path unpacked;
+    Path dstPath;
+    PathSet references;
+    Path deriver;
+};
+
+
+/* Read one path in `nix-store --export' format from `source', unpack
+   its contents to `imp.unpacked' and check its signature. */
+static void readImport(bool requireSignature, Source & source,
+    ImportedPath & imp)
 {
     HashAndReadSource hashAndReadSource(source);
 
     /* We don't yet know what store path this archive contains (the
        store path follows the archive data proper), and besides, we
        don't know yet whether the signature is valid. */
-    Path tmpDir = createTempDirInStore();
-    AutoDelete delTmp(tmpDir);
-    Path unpacked = tmpDir + "/unpacked";
-
-    restorePath(unpacked, hashAndReadSource);
+    restorePath(imp.unpacked, hashAndReadSource);
 
     unsigned int magic = readInt(hashAndReadSource);
     if (magic != EXPORT_MAGIC)
         throw Error("Nix archive cannot be imported; wrong format");
 
-    Path dstPath = readStorePath(hashAndReadSource);
+    imp.dstPath = readStorePath(hashAndReadSource);
 
-    printMsg(lvlInfo, format("importing path `%1%'") % dstPath);
+    printMsg(lvlInfo, format("importing path `%1%'") % imp.dstPath);
 
-    PathSet references = readStorePaths<PathSet>(hashAndReadSource);
+    imp.references = readStorePaths<PathSet>(hashAndReadSource);
 
-    Path deriver = readString(hashAndReadSource);
-    if (deriver != "") assertStorePath(deriver);
+    imp.deriver = readString(hashAndReadSource);
+    if (imp.deriver != "") assertStorePath(imp.deriver);
 
     Hash hash = hashAndReadSource.hashSink.finish().first;
     hashAndReadSource.hashing = false;
@@ -1434,13 +1947,13 @@ Path LocalStore::importPath(bool requireSignature, Source & source)
     bool haveSignature = readInt(hashAndReadSource) == 1;
 
     if (requireSignature && !haveSignature)
-        throw Error(format("imported archive of `%1%' lacks a signature") % dstPath);
+        throw Error(format("imported archive of `%1%' lacks a signature") % imp.dstPath);
 
     if (haveSignature) {
         string signature = readString(hashAndReadSource);
 
         if (requireSignature) {
-            Path sigFile = tmpDir + "/sig";
+            Path sigFile = imp.unpacked + ".sig";
             writeFile(sigFile, signature);
 
             Strings args;
@@ -1463,64 +1976,89 @@ Path LocalStore::importPath(bool requireSignature, Source & source)
                     "to import a Trojan horse");
         }
     }
-
-    /* Do the actual import. */
-
-    /* !!! way too much code duplication with addTextToStore() etc. */
-    addTempRoot(dstPath);
-
-    if (!isValidPath(dstPath)) {
-
-        PathLocks outputLock;
-
-        /* Lock the output path.  But don't lock if we're being called
-           from a build hook (whose parent process already acquired a
-           lock on this path). */
-        Strings locksHeld = tokenizeString<Strings>(getEnv("NIX_HELD_LOCKS"));
-        if (find(locksHeld.begin(), locksHeld.end(), dstPath) == locksHeld.end())
-            outputLock.lockPaths(singleton<PathSet, Path>(dstPath));
-
-        if (!isValidPath(dstPath)) {
-
-            if (pathExists(dstPath)) deletePathWrapped(dstPath);
-
-            if (rename(unpacked.c_str(), dstPath.c_str()) == -1)
-                throw SysError(format("cannot move `%1%' to `%2%'")
-                    % unpacked % dstPath);
-
-            canonicalisePathMetaData(dstPath);
-
-            /* !!! if we were clever, we could prevent the hashPath()
-               here. */
-            HashResult hash = hashPath(htSHA256, dstPath);
-
-            optimisePath(dstPath); // FIXME: combine with hashPath()
-
-            ValidPathInfo info;
-            info.path = dstPath;
-            info.hash = hash.first;
-            info.narSize = hash.second;
-            info.references = references;
-            info.deriver = deriver != "" && isValidPath(deriver) ? deriver : "";
-            registerValidPath(info);
-        }
-
-        outputLock.setDeletion(true);
-    }
-
-    return dstPath;
 }
 
 
 Paths LocalStore::importPaths(bool requireSignature, Source & source)
 {
+    Path tmpDir = createTempDirInStore();
+    AutoDelete delTmp(tmpDir);
+
+    /* Unpack all paths first, so that they can be registered in a
+       single transaction. */
+    std::list<ImportedPath> imports;
     Paths res;
     while (true) {
         unsigned long long n = readLongLong(source);
         if (n == 0) break;
         if (n != 1) throw Error("input doesn't look like something created by `nix-store --export'");
-        res.push_back(importPath(requireSignature, source));
+        ImportedPath imp;
+        imp.unpacked = (format("%1%/%2%") % tmpDir % imports.size()).str();
+        readImport(requireSignature, source, imp);
+        imports.push_back(imp);
+        res.push_back(imp.dstPath);
+    }
+
+    PathSet dstPaths(res.begin(), res.end());
+
+    /* !!! way too much code duplication with addTextToStore() etc. */
+    foreach (PathSet::iterator, i, dstPaths) addTempRoot(*i);
+
+    /* Lock the output paths.  But don't lock if we're being called
+       from a build hook (whose parent process already acquired a
+       lock on these paths). */
+    Strings locksHeld = tokenizeString<Strings>(getEnv("NIX_HELD_LOCKS"));
+    PathSet lockPaths;
+    foreach (PathSet::iterator, i, dstPaths)
+        if (!isValidPath(*i) && find(locksHeld.begin(), locksHeld.end(), *i) == locksHeld.end())
+            lockPaths.insert(*i);
+    PathLocks outputLocks(lockPaths);
+
+    /* Check that the references of every path are valid or part of
+       this import, before touching the store. */
+    foreach (std::list<ImportedPath>::iterator, i, imports)
+        foreach (PathSet::iterator, j, i->references)
+            if (dstPaths.find(*j) == dstPaths.end() && !isValidPath(*j))
+                throw Error(format("cannot import `%1%' because its reference `%2%' is not valid")
+                    % i->dstPath % *j);
+
+    ValidPathInfos infos;
+    PathSet added;
+
+    foreach (std::list<ImportedPath>::iterator, i, imports) {
+        Path & dstPath(i->dstPath);
+        if (isValidPath(dstPath) || added.find(dstPath) != added.end()) continue;
+        added.insert(dstPath);
+
+        if (pathExists(dstPath)) deletePathWrapped(dstPath);
+
+        if (rename(i->unpacked.c_str(), dstPath.c_str()) == -1)
+            throw SysError(format("cannot move `%1%' to `%2%'")
+                % i->unpacked % dstPath);
+
+        canonicalisePathMetaData(dstPath);
+
+        /* !!! if we were clever, we could prevent the hashPath()
+           here. */
+        HashResult hash = hashAndOptimisePath(dstPath);
+
+        ValidPathInfo info;
+        info.path = dstPath;
+        info.hash = hash.first;
+        info.narSize = hash.second;
+        info.references = i->references;
+        info.deriver = i->deriver != "" &&
+            (dstPaths.find(i->deriver) != dstPaths.end() || isValidPath(i->deriver))
+            ? i->deriver : "";
+        infos.push_back(info);
     }
+
+    /* Register all paths in one transaction.  If we crash before
+       this, the moved paths are simply invalid. */
+    registerValidPaths(infos);
+
+    outputLocks.setDeletion(true);
+
     return res;
 }
 
@@ -1549,8 +2087,240 @@ void LocalStore::invalidatePathChecked(const Path & path)
 }
 
 
-bool LocalStore::verifyStore(bool checkContents, bool repair)
+/* The outcome of hashing the path `index' of verifyStore(). */
+struct HashPathResult
 {
+    unsigned int index;
+    bool cancelled;
+    HashResult hash;
+    string error;
+};
+
+
+/* Thrown by RateLimitedHashSink to abandon a path. */
+MakeError(HashCancelled, Error)
+
+
+/* State shared between verifyStore() and the threads that hash
+   store paths for it. */
+struct VerifyStatus
+{
+    pthread_mutex_t mutex;
+
+    /* Signalled when a path has been added to `finished'. */
+    pthread_cond_t available;
+    std::list<HashPathResult> finished;
+
+    /* Rate limiting: the bytes read so far by all threads, and the
+       time at which reading started. */
+    unsigned long long maxRate;
+    unsigned long long bytesRead;
+    struct timeval start;
+
+    /* The time at which paths that are being hashed are abandoned,
+       or 0. */
+    time_t deadline;
+
+    /* Set by the main thread when it stops waiting for results
+       (e.g. because it is handling an interrupt, which resets the
+       interrupt flag). */
+    volatile sig_atomic_t stopped;
+
+    VerifyStatus(unsigned long long maxRate, time_t deadline)
+        : maxRate(maxRate), bytesRead(0), deadline(deadline), stopped(0)
+    {
+        pthread_mutex_init(&mutex, 0);
+        pthread_cond_init(&available, 0);
+        gettimeofday(&start, 0);
+    }
+
+    /* Whether the remaining paths should be abandoned, because the
+       time limit has been reached or the user has interrupted us.
+       Can be called without holding `mutex'. */
+    bool cancelled() const
+    {
+        return stopped || _isInterrupted || (deadline && time(0) >= deadline);
+    }
+
+    ~VerifyStatus()
+    {
+        pthread_cond_destroy(&available);
+        pthread_mutex_destroy(&mutex);
+    }
+};
+
+
+/* Tell the workers to abandon their paths when verifyStore() stops
+   waiting for them, however it exits, so that the pool's destructor
+   doesn't wait for them to finish. */
+struct StopVerify
+{
+    VerifyStatus & status;
+    StopVerify(VerifyStatus & status) : status(status) { }
+    ~StopVerify() { status.stopped = 1; }
+};
+
+
+/* A sink that hashes its input, sleeping as needed to keep the
+   combined rate of all threads below `status.maxRate'.  It throws
+   HashCancelled once `status' is cancelled, so that a large path
+   doesn't hold up verifyStore() past its time limit. */
+struct RateLimitedHashSink : Sink
+{
+    HashSink hashSink;
+    VerifyStatus & status;
+
+    RateLimitedHashSink(HashType ht, VerifyStatus & status)
+        : hashSink(ht), status(status) { }
+
+    void operator () (const unsigned char * data, size_t len)
+    {
+        if (status.cancelled()) throw HashCancelled("hashing cancelled");
+        if (status.maxRate) {
+            double due;
+            {
+                MutexLock lock(status.mutex);
+                status.bytesRead += len;
+                due = status.start.tv_sec + status.start.tv_usec / 1000000.0
+                    + (double) status.bytesRead / status.maxRate;
+            }
+            struct timeval now;
+            gettimeofday(&now, 0);
+            double wait = due - (now.tv_sec + now.tv_usec / 1000000.0);
+            /* Sleep in steps, so that cancellation isn't delayed. */
+            while (wait > 0 && !status.cancelled()) {
+                double step = wait < 1 ? wait : 1;
+                usleep((useconds_t) (step * 1000000));
+                wait -= step;
+            }
+        }
+        hashSink(data, len);
+    }
+};
+
+
+struct HashPathWork : ThreadPool::Work
+{
+    unsigned int index;
+    Path path;
+    HashType ht;
+    VerifyStatus & status;
+
+    HashPathWork(unsigned int index, const ValidPathInfo & info, VerifyStatus & status)
+        : index(index), path(info.path), ht(info.hash.type), status(status) { }
+
+    void run()
+    {
+        HashPathResult result;
+        result.index = index;
+        result.cancelled = false;
+        /* Errors are reported by the main thread; throwing would make
+           the pool discard the remaining paths.  A result is always
+           posted, so that the main thread doesn't wait for it
+           forever.  Interrupts are left to the main thread, which
+           sees the interrupt flag through status.cancelled(). */
+        try {
+            RateLimitedHashSink sink(ht, status);
+            dumpPath(path, sink);
+            result.hash = sink.hashSink.finish();
+        } catch (HashCancelled & e) {
+            result.cancelled = true;
+        } catch (Interrupted & e) {
+            result.cancelled = true;
+        } catch (BaseError & e) {
+            result.error = e.msg();
+        } catch (std::exception & e) {
+            result.error = e.what();
+        }
+        MutexLock lock(status.mutex);
+        status.finished.push_back(result);
+        pthread_cond_signal(&status.available);
+    }
+};
+
+
+struct LargerNarSize
+{
+    bool operator () (const ValidPathInfo & a, const ValidPathInfo & b) const
+    {
+        return a.narSize > b.narSize;
+    }
+};
+
+
+Paths LocalStore::queryPathsByVerificationTime()
+{
+    SQLiteStmt stmt;
+    stmt.create(db,
+        "select path from ValidPaths v left join VerifiedPaths p on p.id = v.id "
+        "order by coalesce(p.time, 0), v.id;");
+
+    Paths res;
+
+    int r;
+    while ((r = sqlite3_step(stmt)) == SQLITE_ROW) {
+        const char * s = (const char *) sqlite3_column_text(stmt, 0);
+        assert(s);
+        res.push_back(s);
+    }
+
+    if (r != SQLITE_DONE)
+        throwSQLiteError(db, "error getting valid paths");
+
+    return res;
+}
+
+
+LocalStore::OptimisedPaths LocalStore::queryOptimisedPaths()
+{
+    SQLiteStmt stmt;
+    stmt.create(db,
+        "select path, o.inode from ValidPaths v left join OptimisedPaths o on o.id = v.id;");
+
+    OptimisedPaths res;
+
+    int r;
+    while ((r = sqlite3_step(stmt)) == SQLITE_ROW) {
+        const char * s = (const char *) sqlite3_column_text(stmt, 0);
+        assert(s);
+        res[s] = sqlite3_column_int64(stmt, 1); /* 0 if null */
+    }
+
+    if (r != SQLITE_DONE)
+        throwSQLiteError(db, "error getting valid paths");
+
+    return res;
+}
+
+
+void LocalStore::markOptimised(const OptimisedPaths & paths)
+{
+    SQLiteStmt stmt;
+    stmt.create(db,
+        "insert or replace into OptimisedPaths (id, inode) select id, ? from ValidPaths where path = ?;");
+
+    while (1) {
+        try {
+            SQLiteTxn txn(db);
+            foreach (OptimisedPaths::const_iterator, i, paths) {
+                SQLiteStmtUse use(stmt);
+                stmt.bind64(i->second);
+                stmt.bind(i->first);
+                if (sqlite3_step(stmt) != SQLITE_DONE)
+                    throwSQLiteError(db, format("recording optimisation of `%1%'") % i->first);
+            }
+            txn.commit();
+            break;
+        } catch (SQLiteBusy & e) { };
+    }
+}
+
+
+bool LocalStore::verifyStore(bool checkContents, bool repair,
+    unsigned int maxPaths, unsigned int maxTime)
+{
+    time_t startTime = time(0);
+
     printMsg(lvlError, format("reading the Nix store..."));
 
     bool errors = false;
@@ -1577,53 +2347,172 @@ bool LocalStore::verifyStore(bool checkContents, bool repair)
     if (checkContents) {
         printMsg(lvlInfo, "checking hashes...");
 
-        Hash nullHash(htSHA256);
+        /* In incremental mode, pick the least recently verified
+           paths. */
+        bool incremental = maxPaths != 0 || maxTime != 0;
+        Paths todo;
+        if (incremental) {
+            Paths sorted = queryPathsByVerificationTime();
+            foreach (Paths::iterator, i, sorted) {
+                if (maxPaths && todo.size() >= maxPaths) break;
+                if (validPaths.find(*i) != validPaths.end()) todo.push_back(*i);
+            }
+        } else
+            todo = Paths(validPaths.begin(), validPaths.end());
 
-        foreach (PathSet::iterator, i, validPaths) {
+        std::vector<ValidPathInfo> infos;
+        unsigned long long totalSize = 0;
+        foreach (Paths::iterator, i, todo) {
             try {
-                ValidPathInfo info = queryPathInfo(*i);
-
-                /* Check the content hash (optionally - slow). */
-                printMsg(lvlTalkative, format("checking contents of `%1%'") % *i);
-                HashResult current = hashPath(info.hash.type, *i);
-
-                if (info.hash != nullHash && info.hash != current.first) {
-                    printMsg(lvlError, format("path `%1%' was modified! "
-                            "expected hash `%2%', got `%3%'")
-                        % *i % printHash(info.hash) % printHash(current.first));
-                    if (repair) repairPath(*i); else errors = true;
-                } else {
-
-                    bool update = false;
-
-                    /* Fill in missing hashes. */
-                    if (info.hash == nullHash) {
-                        printMsg(lvlError, format("fixing missing hash on `%1%'") % *i);
-                        info.hash = current.first;
-                        update = true;
-                    }
+                infos.push_back(queryPathInfo(*i));
+                totalSize += infos.back().narSize;
+            } catch (Error & e) {
+                /* It's possible that the path got GC'ed. */
+                printMsg(lvlError, format("warning: %1%") % e.msg());
+                errors = true;
+            }
+        }
+
+        /* Hash the largest paths first, so that the pool isn't left
+           waiting for a single huge path at the end.  With a time
+           limit, stick to the least recently verified paths
+           instead. */
+        if (!maxTime)
+            std::sort(infos.begin(), infos.end(), LargerNarSize());
+
+        SQLiteStmt stmtMarkVerified;
+        stmtMarkVerified.create(db,
+            "insert or replace into VerifiedPaths (id, time, good) select id, ?, ? from ValidPaths where path = ?;");
+
+        VerifyStatus status(settings.verifyMaxRate,
+            maxTime ? startTime + (time_t) maxTime : 0);
+        ThreadPool pool(settings.verifyThreads);
+        StopVerify stopVerify(status); /* destroyed before `pool' */
+
+        /* Only keep a few paths queued per thread, rather than
+           queueing all of them up front, so that there is little to
+           discard if we stop early. */
+        unsigned int queued = 0, received = 0, window = 2 * pool.size();
+
+        Hash nullHash(htSHA256);
+        unsigned int checked = 0;
+        unsigned long long bytesChecked = 0;
+        time_t lastReport = time(0);
+
+        while (checked < infos.size()) {
+
+            if (status.cancelled()) {
+                checkInterrupt();
+                /* Paths that are being hashed right now are
+                   abandoned; they'll be checked first next time. */
+                printMsg(lvlInfo, format("time limit reached after checking %1% of %2% paths")
+                    % checked % infos.size());
+                break;
+            }
+
+            while (queued < infos.size() && queued - received < window) {
+                pool.enqueue(new HashPathWork(queued, infos[queued], status));
+                queued++;
+            }
+
+            /* Wait for the workers to finish some paths. */
+            std::list<HashPathResult> finished;
+            {
+                MutexLock lock(status.mutex);
+                while (status.finished.empty() && !status.cancelled() && !pool.hasFailed()) {
+                    struct timespec t;
+                    clock_gettime(CLOCK_REALTIME, &t);
+                    t.tv_sec++;
+                    pthread_cond_timedwait(&status.available, &status.mutex, &t);
+                }
+                finished.swap(status.finished);
+            }
+
+            /* Shouldn't happen, but rethrow rather than wait for
+               results that will never come. */
+            if (pool.hasFailed()) pool.process();
+
+            received += finished.size();
+
+            foreach (std::list<HashPathResult>::iterator, j, finished) {
+                if (j->cancelled) continue;
+                checked++;
+                ValidPathInfo & info(infos[j->index]);
+                const Path & path(info.path);
+
+                if (j->error != "") {
+                    /* It's possible that the path got GC'ed, so
+                       ignore errors on invalid paths. */
+                    if (isValidPath(path))
+                        printMsg(lvlError, format("error: %1%") % j->error);
+                    else
+                        printMsg(lvlError, format("warning: %1%") % j->error);
+                    errors = true;
+                    continue;
+                }
+
+                HashResult & current(j->hash);
+                bytesChecked += current.second;
+
+                try {
+
+                    bool good = true;
+
+                    if (info.hash != nullHash && info.hash != current.first) {
+                        printMsg(lvlError, format("path `%1%' was modified! "
+                                "expected hash `%2%', got `%3%'")
+                            % path % printHash(info.hash) % printHash(current.first));
+                        if (repair) repairPath(path); else errors = true;
+                        good = repair;
+                    } else {
+
+                        bool update = false;
+
+                        /* Fill in missing hashes. */
+                        if (info.hash == nullHash) {
+                            printMsg(lvlError, format("fixing missing hash on `%1%'") % path);
+                            info.hash = current.first;
+                            update = true;
+                        }
+
+                        /* Fill in missing narSize fields (from old stores). */
+                        if (info.narSize == 0) {
+                            printMsg(lvlError, format("updating size field on `%1%' to %2%") % path % current.second);
+                            info.narSize = current.second;
+                            update = true;
+                        }
+
+                        if (update) updatePathInfo(info);
 
-                    /* Fill in missing narSize fields (from old stores). */
-                    if (info.narSize == 0) {
-                        printMsg(lvlError, format("updating size field on `%1%' to %2%") % *i % current.second);
-                        info.narSize = current.second;
-                        update = true;
                     }
 
-                    if (update) updatePathInfo(info);
+                    SQLiteStmtUse use(stmtMarkVerified);
+                    stmtMarkVerified.bind64(time(0));
+                    stmtMarkVerified.bind(good ? 1 : 0);
+                    stmtMarkVerified.bind(path);
+                    if (sqlite3_step(stmtMarkVerified) != SQLITE_DONE)
+                        throwSQLiteError(db, format("recording verification of `%1%'") % path);
+
+                    printMsg(lvlTalkative, format("checked `%1%'") % path);
 
+                } catch (Error & e) {
+                    if (isValidPath(path))
+                        printMsg(lvlError, format("error: %1%") % e.msg());
+                    else
+                        printMsg(lvlError, format("warning: %1%") % e.msg());
+                    errors = true;
                 }
+            }
 
-            } catch (Error & e) {
-                /* It's possible that the path got GC'ed, so ignore
-                   errors on invalid paths. */
-                if (isValidPath(*i))
-                    printMsg(lvlError, format("error: %1%") % e.msg());
-                else
-                    printMsg(lvlError, format("warning: %1%") % e.msg());
-                errors = true;
+            if (time(0) >= lastReport + 5 || checked == infos.size()) {
+                lastReport = time(0);
+                printMsg(lvlInfo, format("checked %1% of %2% paths (%3$.1f of %4$.1f MiB)")
+                    % checked % infos.size()
+                    % (bytesChecked / (1024.0 * 1024.0)) % (totalSize / (1024.0 * 1024.0)));
             }
         }
+
+        if (checked == infos.size()) pool.process();
     }
 
     return errors;
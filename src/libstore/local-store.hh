@@ -5,6 +5,7 @@
 #include "store-api.hh"
 #include "util.hh"
 #include "pathlocks.hh"
+#include "binary-cache.hh"
 
 
 class sqlite3;
@@ -25,6 +26,9 @@ extern string drvsLogDir;
 
 
 struct Derivation;
+struct FileHashSink;
+struct OptimiseState;
+class ThreadPool;
 
 
 struct OptimiseStats
@@ -34,14 +38,37 @@ struct OptimiseStats
     unsigned long filesLinked;
     unsigned long long bytesFreed;
     unsigned long long blocksFreed;
+    unsigned long filesHashed;
+    unsigned long long bytesHashed;
+    double seconds; /* time spent hashing and linking */
+    unsigned long pathsSkipped; /* already optimised by an earlier run */
+    unsigned long filesShared; /* with optimise-method = reflink */
+    unsigned long long bytesShared;
     OptimiseStats()
     {
-        totalFiles = sameContents = filesLinked = 0;
-        bytesFreed = blocksFreed = 0;
+        totalFiles = sameContents = filesLinked = filesHashed = pathsSkipped = filesShared = 0;
+        bytesFreed = blocksFreed = bytesHashed = bytesShared = 0;
+        seconds = 0;
     }
 };
 
 
+/* A snapshot of the valid paths and the references between them.
+   Paths are identified by their index in `paths', which keeps the
+   graph compact enough to hold the entire store in memory. */
+struct PathGraph
+{
+    typedef std::vector<std::pair<unsigned int, unsigned int> > Edges;
+    std::vector<Path> paths;
+    std::vector<unsigned long long> narSizes;
+    std::vector<time_t> registrationTimes;
+    /* Pairs (referrer, reference). */
+    Edges references;
+    /* Pairs (derivation, output) for all valid outputs. */
+    Edges outputs;
+};
+
+
 struct RunningSubstituter
 {
     Pid pid;
@@ -85,6 +112,10 @@ private:
 
     Path linksDir;
 
+    /* Symlinks to the files that identical files share their blocks
+       with if optimise-method is `reflink'. */
+    Path reflinksDir;
+
 public:
 
     /* Initialise the local store, upgrading the schema if
@@ -109,6 +140,11 @@ public:
 
     void queryReferrers(const Path & path, PathSet & referrers);
 
+    /* Computes the closure in the database, one level of the graph
+       per query. */
+    void queryClosure(const PathSet & paths, PathSet & closure,
+        bool flipDirection = false, bool includeOutputs = false);
+
     Path queryDeriver(const Path & path);
 
     /* Return all currently valid derivations that have `path' as an
@@ -123,6 +159,14 @@ public:
 
     Path queryPathFromHashPart(const string & hashPart);
 
+    void queryBuildTimes(const PathSet & drvPaths, BuildTimes & times);
+
+    /* Look up the last build of `drv' (stored at `drvPath'). */
+    bool queryBuildTime(const Path & drvPath, const Derivation & drv, BuildTime & time);
+
+    /* Record a successful local build of `drv'. */
+    void registerBuildTime(const Path & drvPath, const Derivation & drv, const BuildTime & time);
+
     PathSet querySubstitutablePaths(const PathSet & paths);
 
     void querySubstitutablePathInfos(const Path & substituter,
@@ -142,6 +186,34 @@ public:
     Path addToStoreFromDump(const string & dump, const string & name,
         bool recursive = true, HashType hashAlgo = htSHA256, bool repair = false);
 
+    /* Like the previous function, but read the dump from `dump' and
+       unpack it while it is being read, so that memory use doesn't
+       depend on the size of the dump. */
+    Path addToStoreFromDump(Source & dump, const string & name,
+        bool recursive = true, HashType hashAlgo = htSHA256, bool repair = false);
+
+    /* The two halves of the previous function.  unpackDump() unpacks
+       `dump' into `tmpPath' (which must be in a directory created by
+       createTempDirInStore()) while reading it, and returns the store
+       path to add it as, setting `narHash' if it's known and filling
+       in `fileHashes'.  If a non-recursive dump isn't a single
+       regular file, it is still read completely, but "" is returned.
+       addTempPathToStore() then moves it into place. */
+    Path createTempDirInStore();
+
+    Path unpackDump(Source & dump, const Path & tmpPath, const string & name,
+        bool recursive, HashType hashAlgo, HashResult & narHash,
+        FileHashSink & fileHashes);
+
+    /* Move `tmpPath' (which must reside in a temporary directory in
+       the store) to `dstPath' and register it as valid, unless
+       `dstPath' is already valid.  `narHash' is the SHA-256 hash of
+       the NAR serialisation of `tmpPath', or a null hash if it's not
+       known yet.  If it is known, `fileHashes' should hold the file
+       hashes needed by optimisePath(), collected along with it. */
+    Path addTempPathToStore(const Path & tmpPath, const Path & dstPath,
+        const HashResult & narHash, bool repair, FileHashSink * fileHashes = 0);
+
     Path addTextToStore(const string & name, const string & s,
         const PathSet & references, bool repair = false);
 
@@ -171,9 +243,20 @@ public:
     /* Optimise a single store path. */
     void optimisePath(const Path & path);
 
+    /* Likewise, using the file hashes computed by `fileHashes' while
+       `path' was dumped, rather than reading the files again. */
+    void optimisePath(const Path & path, FileHashSink & fileHashes);
+
+    /* Compute the SHA-256 NAR hash of `path' and optimise it, reading
+       it only once. */
+    HashResult hashAndOptimisePath(const Path & path);
+
     /* Check the integrity of the Nix store.  Returns true if errors
-       remain. */
-    bool verifyStore(bool checkContents, bool repair);
+       remain.  If `maxPaths' or `maxTime' (in seconds) is non-zero,
+       only the contents of the least recently verified paths are
+       checked, until either limit is reached. */
+    bool verifyStore(bool checkContents, bool repair,
+        unsigned int maxPaths = 0, unsigned int maxTime = 0);
 
     /* Register the validity of a path, i.e., that `path' exists, that
        the paths referenced by it exists, and in the case of an output
@@ -210,6 +293,11 @@ public:
 
     void setSubstituterEnv();
 
+    /* Unpack `storePath' into `destPath' from a binary cache in a
+       local directory, and return its expected NAR hash.  This is
+       the `--substitute' operation of the builtin substituter. */
+    string substituteFromBinaryCache(const Path & storePath, const Path & destPath);
+
 private:
 
     Path schemaPath;
@@ -236,12 +324,42 @@ private:
     SQLiteStmt stmtQueryValidDerivers;
     SQLiteStmt stmtQueryDerivationOutputs;
     SQLiteStmt stmtQueryPathFromHashPart;
+    SQLiteStmt stmtRegisterBuildTime;
+    SQLiteStmt stmtQueryBuildTime;
+    SQLiteStmt stmtQueryDataVersion;
+    SQLiteStmt stmtClosureClear;
+    SQLiteStmt stmtClosureInsert;
+    SQLiteStmt stmtClosureReferences;
+    SQLiteStmt stmtClosureReferrers;
+    SQLiteStmt stmtClosureOutputs;
+    SQLiteStmt stmtClosureResult;
 
     /* Cache for pathContentsGood(). */
     std::map<Path, bool> pathContentsGoodCache;
 
+    /* LRU cache of the info of valid paths, bounded by
+       settings.pathInfoCacheSize.  It is dropped when another process
+       changes the database (see checkPathInfoCache()). */
+    typedef std::list<Path> PathInfoLRU;
+    struct CachedPathInfo
+    {
+        ValidPathInfo info;
+        PathInfoLRU::iterator lru;
+    };
+    typedef std::map<Path, CachedPathInfo> PathInfoCache;
+    PathInfoCache pathInfoCache;
+    PathInfoLRU pathInfoLRU;
+    long long pathInfoDataVersion;
+
+    bool checkPathInfoCache();
+    bool lookupPathInfo(const Path & path, ValidPathInfo & info);
+    void cachePathInfo(const ValidPathInfo & info);
+    void uncachePathInfo(const Path & path);
+
     bool didSetSubstituterEnv;
 
+    LocalBinaryCaches localBinaryCaches;
+
     int getSchema();
 
     void openDB(bool create);
@@ -263,6 +381,16 @@ private:
     /* Delete a path from the Nix store. */
     void invalidatePathChecked(const Path & path);
 
+    /* Return all valid paths, least recently verified first. */
+    Paths queryPathsByVerificationTime();
+
+    /* Return all valid paths, mapped to their inode at the time they
+       were last optimised, or 0 if they never were. */
+    typedef std::map<Path, unsigned long long> OptimisedPaths;
+    OptimisedPaths queryOptimisedPaths();
+
+    void markOptimised(const OptimisedPaths & paths);
+
     void verifyPath(const Path & path, const PathSet & store,
         PathSet & done, PathSet & validPaths, bool repair, bool & errors);
 
@@ -272,11 +400,18 @@ private:
     PathSet queryValidPathsOld();
     ValidPathInfo queryPathInfoOld(const Path & path);
 
+    /* Read the entire reference graph of the valid paths. */
+    void queryPathGraph(PathGraph & graph);
+
     struct GCState;
 
     void deleteGarbage(GCState & state, const Path & path);
 
-    bool tryToDelete(GCState & state, const Path & path);
+    void deleteValidPath(GCState & state, unsigned int node);
+
+    bool canDeleteInvalid(GCState & state, const Path & path);
+
+    void deleteInvalidPath(GCState & state, const Path & path);
 
     bool isActiveTempFile(const GCState & state,
         const Path & path, const string & suffix);
@@ -288,13 +423,22 @@ private:
     void startSubstituter(const Path & substituter,
         RunningSubstituter & runningSubstituter);
 
-    Path createTempDirInStore();
+    void checkDerivationOutputs(const Path & drvPath, const Derivation & drv);
 
-    Path importPath(bool requireSignature, Source & source);
+    void optimisePath_(OptimiseStats & stats, const Path & path,
+        const struct stat & st);
 
-    void checkDerivationOutputs(const Path & drvPath, const Derivation & drv);
+    void optimiseTree_(OptimiseStats & stats, const Path & path,
+        const struct stat & st, ThreadPool & pool, OptimiseState & state);
+
+    void linkHashedFiles(OptimiseStats & stats, OptimiseState & state,
+        ThreadPool & pool);
+
+    void optimiseFile_(OptimiseStats & stats, const Path & path,
+        const struct stat & st, const Hash & hash, OptimiseState * state = 0);
 
-    void optimisePath_(OptimiseStats & stats, const Path & path);
+    void shareFile_(OptimiseStats & stats, const Path & path,
+        const struct stat & st, const Hash & hash);
 };
 
 
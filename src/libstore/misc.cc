@@ -19,23 +19,15 @@ void computeFSClosure(StoreAPI & store, const Path & storePath,
     PathSet & paths, bool flipDirection, bool includeOutputs)
 {
     if (paths.find(storePath) != paths.end()) return;
-    paths.insert(storePath);
+    store.queryClosure(singleton<PathSet>(storePath), paths,
+        flipDirection, includeOutputs);
+}
 
-    PathSet references;
-    if (flipDirection)
-        store.queryReferrers(storePath, references);
-    else
-        store.queryReferences(storePath, references);
-
-    if (includeOutputs && isDerivation(storePath)) {
-        PathSet outputs = store.queryDerivationOutputs(storePath);
-        foreach (PathSet::iterator, i, outputs)
-            if (store.isValidPath(*i))
-                computeFSClosure(store, *i, paths, flipDirection, true);
-    }
 
-    foreach (PathSet::iterator, i, references)
-        computeFSClosure(store, *i, paths, flipDirection, includeOutputs);
+void computeFSClosure(StoreAPI & store, const PathSet & storePaths,
+    PathSet & paths, bool flipDirection, bool includeOutputs)
+{
+    store.queryClosure(storePaths, paths, flipDirection, includeOutputs);
 }
 
 
@@ -160,6 +152,49 @@ void queryMissing(StoreAPI & store, const PathSet & targets,
 }
 
 
+/* Return the time needed to build `drvPath' and, one after the other,
+   the chain of its dependencies in `willBuild' that takes longest. */
+static time_t finishTime(StoreAPI & store, const PathSet & willBuild,
+    const BuildTimes & times, const Path & drvPath,
+    std::map<Path, time_t> & finish)
+{
+    std::map<Path, time_t>::iterator i = finish.find(drvPath);
+    if (i != finish.end()) return i->second;
+
+    time_t inputs = 0;
+    Derivation drv = derivationFromPath(store, drvPath);
+    foreach (DerivationInputs::iterator, j, drv.inputDrvs)
+        if (willBuild.find(j->first) != willBuild.end())
+            inputs = std::max(inputs, finishTime(store, willBuild, times, j->first, finish));
+
+    BuildTimes::const_iterator j = times.find(drvPath);
+    return finish[drvPath] = inputs + (j == times.end() ? 0 : j->second.duration);
+}
+
+
+time_t estimateBuildTime(StoreAPI & store, const PathSet & willBuild,
+    unsigned int & nrKnown)
+{
+    BuildTimes times;
+    store.queryBuildTimes(willBuild, times);
+    nrKnown = times.size();
+    if (times.empty()) return 0;
+
+    /* The builds take at least as long as the longest chain of
+       dependent builds, and as long as all of them spread over the
+       available build slots. */
+    time_t total = 0, longest = 0;
+    foreach (BuildTimes::iterator, i, times)
+        total += i->second.duration;
+
+    std::map<Path, time_t> finish;
+    foreach (PathSet::const_iterator, i, willBuild)
+        longest = std::max(longest, finishTime(store, willBuild, times, *i, finish));
+
+    return std::max(longest, (time_t) (total / std::max(settings.maxBuildJobs, 1U)));
+}
+
+
 static void dfsVisit(StoreAPI & store, const PathSet & paths,
     const Path & path, PathSet & visited, Paths & sorted,
     PathSet & parents)
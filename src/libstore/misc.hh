@@ -21,6 +21,12 @@ void computeFSClosure(StoreAPI & store, const Path & storePath,
     PathSet & paths, bool flipDirection = false,
     bool includeOutputs = false);
 
+/* Likewise for all paths in `storePaths' at once, which is much
+   faster than one at a time. */
+void computeFSClosure(StoreAPI & store, const PathSet & storePaths,
+    PathSet & paths, bool flipDirection = false,
+    bool includeOutputs = false);
+
 /* Return the path corresponding to the output identifier `id' in the
    given derivation. */
 Path findOutput(const Derivation & drv, string id);
@@ -32,5 +38,13 @@ void queryMissing(StoreAPI & store, const PathSet & targets,
     PathSet & willBuild, PathSet & willSubstitute, PathSet & unknown,
     unsigned long long & downloadSize, unsigned long long & narSize);
 
+/* Estimate the wall-clock time in seconds needed to build the
+   derivations in `willBuild' (as returned by queryMissing()), from
+   how long earlier builds of them took.  `nrKnown' is set to the
+   number of derivations that have been built before; the others
+   count as taking no time. */
+time_t estimateBuildTime(StoreAPI & store, const PathSet & willBuild,
+    unsigned int & nrKnown);
+
 
 }
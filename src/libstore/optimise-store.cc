@@ -4,12 +4,24 @@
 #include "local-store.hh"
 #include "immutable.hh"
 #include "globals.hh"
+#include "archive.hh"
+#include "thread-pool.hh"
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <unistd.h>
 #include <errno.h>
 #include <stdio.h>
+#include <dirent.h>
+#include <time.h>
+#include <fcntl.h>
+#include <string.h>
+
+#if HAVE_LINUX_FS_H
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
 
 
 namespace nix {
@@ -42,18 +54,61 @@ struct MakeReadOnly
 };
 
 
-void LocalStore::optimisePath_(OptimiseStats & stats, const Path & path)
+/* Sometimes SNAFUs can cause files in the Nix store to be modified,
+   in particular when running programs as root under NixOS (example:
+   $fontconfig/var/cache being modified).  Skip those files.  FIXME:
+   check the modification time. */
+static bool isSuspicious(const Path & path, const struct stat & st)
+{
+    if (S_ISREG(st.st_mode) && (st.st_mode & S_IWUSR)) {
+        printMsg(lvlError, format("skipping suspicious writable file `%1%'") % path);
+        return true;
+    }
+    return false;
+}
+
+
+typedef std::list<std::pair<string, struct stat> > DirEntries;
+
+
+/* Return the entries of directory `path' that may need optimising,
+   with their lstat() information.  The file system usually tells us
+   the type of each entry, so the others aren't stat'ed at all.  The
+   entries are read up front because optimiseFile_() replaces them. */
+static void readEntries(const Path & path, DirEntries & entries)
+{
+    DirIterator dir(path);
+
+    Strings names;
+    while (dir.next()) {
+        unsigned char type = dir.type();
+        if (type != DT_UNKNOWN && type != DT_DIR && type != DT_REG
+#if CAN_LINK_SYMLINK
+            && type != DT_LNK
+#endif
+            ) continue;
+        names.push_back(dir.name());
+    }
+
+    foreach (Strings::iterator, i, names) {
+        struct stat st;
+        if (fstatat(dir.fd(), i->c_str(), &st, AT_SYMLINK_NOFOLLOW))
+            throw SysError(format("getting attributes of path `%1%/%2%'") % path % *i);
+        entries.push_back(std::pair<string, struct stat>(*i, st));
+    }
+}
+
+
+void LocalStore::optimisePath_(OptimiseStats & stats, const Path & path,
+    const struct stat & st)
 {
     checkInterrupt();
-    
-    struct stat st;
-    if (lstat(path.c_str(), &st))
-        throw SysError(format("getting attributes of path `%1%'") % path);
 
     if (S_ISDIR(st.st_mode)) {
-        Strings names = readDirectory(path);
-        foreach (Strings::iterator, i, names)
-            optimisePath_(stats, path + "/" + *i);
+        DirEntries entries;
+        readEntries(path, entries);
+        foreach (DirEntries::iterator, i, entries)
+            optimisePath_(stats, path + "/" + i->first, i->second);
         return;
     }
 
@@ -64,15 +119,6 @@ void LocalStore::optimisePath_(OptimiseStats & stats, const Path & path)
 #endif
         ) return;
 
-    /* Sometimes SNAFUs can cause files in the Nix store to be
-       modified, in particular when running programs as root under
-       NixOS (example: $fontconfig/var/cache being modified).  Skip
-       those files.  FIXME: check the modification time. */
-    if (S_ISREG(st.st_mode) && (st.st_mode & S_IWUSR)) {
-        printMsg(lvlError, format("skipping suspicious writable file `%1%'") % path);
-        return;
-    }
-
     /* Hash the file.  Note that hashPath() returns the hash over the
        NAR serialisation, which includes the execute bit on the file.
        Thus, executable and non-executable files with the same
@@ -82,29 +128,209 @@ void LocalStore::optimisePath_(OptimiseStats & stats, const Path & path)
        Also note that if `path' is a symlink, then we're hashing the
        contents of the symlink (i.e. the result of readlink()), not
        the contents of the target (which may not even exist). */
-    Hash hash = hashPath(htSHA256, path).first;
+    if (!isSuspicious(path, st))
+        optimiseFile_(stats, path, st, hashPath(htSHA256, path).first);
+}
+
+
+static bool useReflinks()
+{
+    if (settings.optimiseMethod == "hardlink") return false;
+    if (settings.optimiseMethod == "reflink") return true;
+    throw Error(format("configuration option `optimise-method' should be either `hardlink' or `reflink', not `%1%'")
+        % settings.optimiseMethod);
+}
+
+
+/* Ask the file system to share the blocks of `dest' with those of
+   `source', which should have the same contents.  The kernel checks
+   that they do, so this is safe even if one of them is modified
+   meanwhile.  Return the number of bytes shared. */
+static unsigned long long dedupeFile(const Path & source, const Path & dest,
+    unsigned long long size)
+{
+#if defined(FIDEDUPERANGE)
+    AutoCloseFD fdSource = open(source.c_str(), O_RDONLY);
+    if (fdSource == -1) throw SysError(format("opening `%1%'") % source);
+
+    /* Owners (and root) may deduplicate into a read-only file. */
+    AutoCloseFD fdDest = open(dest.c_str(), O_RDONLY);
+    if (fdDest == -1) throw SysError(format("opening `%1%'") % dest);
+
+    std::vector<char> buf(sizeof(struct file_dedupe_range) + sizeof(struct file_dedupe_range_info));
+    struct file_dedupe_range * range = (struct file_dedupe_range *) &buf[0];
+    struct file_dedupe_range_info * info = &range->info[0];
+
+    /* File systems may limit the length of a single request, so
+       proceed in chunks. */
+    const unsigned long long maxChunk = 16 * 1024 * 1024;
+
+    unsigned long long offset = 0;
+    while (offset < size) {
+        memset(&buf[0], 0, buf.size());
+        range->src_offset = offset;
+        range->src_length = size - offset < maxChunk ? size - offset : maxChunk;
+        range->dest_count = 1;
+        info->dest_fd = fdDest;
+        info->dest_offset = offset;
+
+        if (ioctl(fdSource, FIDEDUPERANGE, range) == -1) {
+            if (errno == EOPNOTSUPP || errno == ENOTTY || errno == EXDEV || errno == EINVAL)
+                throw SysError(format("the file system holding `%1%' doesn't support `optimise-method = reflink'") % dest);
+            throw SysError(format("sharing the blocks of `%1%' with `%2%'") % dest % source);
+        }
+
+        if (info->status == FILE_DEDUPE_RANGE_DIFFERS) break;
+        if (info->status < 0) {
+            errno = -info->status;
+            throw SysError(format("sharing the blocks of `%1%' with `%2%'") % dest % source);
+        }
+        if (info->bytes_deduped == 0) break;
+
+        offset += info->bytes_deduped;
+    }
+
+    return offset;
+#else
+    throw Error("`optimise-method = reflink' is not supported on this platform");
+#endif
+}
+
+
+/* The outcome of hashing a file for optimiseStore(). */
+struct HashFileResult
+{
+    Path path;
+    struct stat st;
+    bool interrupted;
+    Hash hash;
+    string error;
+};
+
+
+/* State of an optimiseStore() run: an index of the links directory,
+   so that we don't have to look up every hash in it, and the files
+   being hashed by the thread pool. */
+struct OptimiseState
+{
+    /* The names of the entries in the links directory, and their
+       inodes. */
+    std::set<string> links;
+    std::set<ino_t> linkInodes;
+
+    pthread_mutex_t mutex;
+
+    /* Signalled when a file has been added to `finished'. */
+    pthread_cond_t available;
+    std::list<HashFileResult> finished;
+
+    /* The number of files queued but not yet linked. */
+    unsigned int pending;
+
+    struct timeval start;
+    time_t lastReport;
+
+    OptimiseState() : pending(0), lastReport(time(0))
+    {
+        gettimeofday(&start, 0);
+        pthread_mutex_init(&mutex, 0);
+        pthread_cond_init(&available, 0);
+    }
+
+    ~OptimiseState()
+    {
+        pthread_cond_destroy(&available);
+        pthread_mutex_destroy(&mutex);
+    }
+};
+
+
+struct HashFileWork : ThreadPool::Work
+{
+    Path path;
+    struct stat st;
+    OptimiseState & state;
+
+    HashFileWork(const Path & path, const struct stat & st, OptimiseState & state)
+        : path(path), st(st), state(state) { }
+
+    void run()
+    {
+        HashFileResult result;
+        result.path = path;
+        result.st = st;
+        result.interrupted = false;
+        /* Errors are reported by the main thread; throwing would make
+           the pool discard the remaining files.  A result is always
+           posted, so that the main thread doesn't wait for it
+           forever.  The interrupt itself is handled by the main
+           thread, since workers leave the interrupt flag set. */
+        try {
+            result.hash = hashPath(htSHA256, path).first;
+        } catch (Interrupted & e) {
+            result.interrupted = true;
+        } catch (BaseError & e) {
+            result.error = e.msg();
+        } catch (std::exception & e) {
+            result.error = e.what();
+        }
+        MutexLock lock(state.mutex);
+        state.finished.push_back(result);
+        pthread_cond_signal(&state.available);
+    }
+};
+
+
+/* Replace `path' by a hard link to a file with the same contents, if
+   there is one; `hash' is the hash of its NAR serialisation.  If
+   `state' is given, its index of the links directory is used and
+   kept up to date. */
+void LocalStore::optimiseFile_(OptimiseStats & stats, const Path & path,
+    const struct stat & st, const Hash & hash, OptimiseState * state)
+{
+    if (useReflinks()) {
+        shareFile_(stats, path, st, hash);
+        return;
+    }
+
     stats.totalFiles++;
     printMsg(lvlDebug, format("`%1%' has hash `%2%'") % path % printHash(hash));
 
-    /* Check if this is a known hash. */
-    Path linkPath = linksDir + "/" + printHash32(hash);
+    /* Check if this is a known hash.  The index tells us without a
+       system call if it isn't; if it says it is, the link may still
+       have been removed by the garbage collector since. */
+    string name = printHash32(hash);
+    Path linkPath = linksDir + "/" + name;
+
+    bool known = !state || state->links.find(name) != state->links.end();
+
+    struct stat stLink;
+    if (known && lstat(linkPath.c_str(), &stLink) == -1) {
+        if (errno != ENOENT)
+            throw SysError(format("getting attributes of path `%1%'") % linkPath);
+        known = false;
+    }
 
-    if (!pathExists(linkPath)) {
+    if (!known) {
         /* Nope, create a hard link in the links directory. */
         makeMutable(path);
-        if (link(path.c_str(), linkPath.c_str()) == 0) return;
+        if (link(path.c_str(), linkPath.c_str()) == 0) {
+            if (state) {
+                state->links.insert(name);
+                state->linkInodes.insert(st.st_ino);
+            }
+            return;
+        }
         if (errno != EEXIST)
             throw SysError(format("cannot link `%1%' to `%2%'") % linkPath % path);
         /* Fall through if another process created ‘linkPath’ before
            we did. */
+        if (lstat(linkPath.c_str(), &stLink))
+            throw SysError(format("getting attributes of path `%1%'") % linkPath);
     }
 
     /* Yes!  We've seen a file with the same contents.  Replace the
        current file with a hard link to that file. */
-    struct stat stLink;
-    if (lstat(linkPath.c_str(), &stLink))
-        throw SysError(format("getting attributes of path `%1%'") % linkPath);
-
     stats.sameContents++;
     if (st.st_ino == stLink.st_ino) {
         printMsg(lvlDebug, format("`%1%' is already linked to `%2%'") % path % linkPath);
@@ -166,23 +392,260 @@ void LocalStore::optimisePath_(OptimiseStats & stats, const Path & path)
 }
 
 
+/* Read the links directory into `state'.  The inodes come from
+   readdir(), so this doesn't need to stat every link. */
+static void readLinks(const Path & linksDir, OptimiseState & state)
+{
+    AutoCloseDir dir = opendir(linksDir.c_str());
+    if (!dir) throw SysError(format("opening directory `%1%'") % linksDir);
+
+    struct dirent * dirent;
+    while (errno = 0, dirent = readdir(dir)) {
+        checkInterrupt();
+        string name = dirent->d_name;
+        if (name == "." || name == "..") continue;
+        state.links.insert(name);
+        state.linkInodes.insert(dirent->d_ino);
+    }
+    if (errno) throw SysError(format("reading directory `%1%'") % linksDir);
+}
+
+
+/* Queue the files in `path' for hashing, skipping those that are
+   already hard-linked to an entry in the links directory. */
+void LocalStore::optimiseTree_(OptimiseStats & stats, const Path & path,
+    const struct stat & st, ThreadPool & pool, OptimiseState & state)
+{
+    checkInterrupt();
+
+    if (S_ISDIR(st.st_mode)) {
+        DirEntries entries;
+        readEntries(path, entries);
+        foreach (DirEntries::iterator, i, entries)
+            optimiseTree_(stats, path + "/" + i->first, i->second, pool, state);
+        return;
+    }
+
+    if (!S_ISREG(st.st_mode)
+#if CAN_LINK_SYMLINK
+        && !S_ISLNK(st.st_mode)
+#endif
+        ) return;
+
+    if (isSuspicious(path, st)) return;
+
+    if (st.st_nlink > 1 && state.linkInodes.find(st.st_ino) != state.linkInodes.end()) {
+        printMsg(lvlDebug, format("`%1%' is already linked") % path);
+        stats.totalFiles++;
+        stats.sameContents++;
+        return;
+    }
+
+    /* Don't let the queue grow without bound. */
+    while (state.pending >= pool.size() * 16)
+        linkHashedFiles(stats, state, pool);
+
+    pool.enqueue(new HashFileWork(path, st, state));
+    state.pending++;
+}
+
+
+/* Wait for the pool to hash some files, and link them. */
+void LocalStore::linkHashedFiles(OptimiseStats & stats, OptimiseState & state,
+    ThreadPool & pool)
+{
+    std::list<HashFileResult> finished;
+    bool failed = false;
+    {
+        MutexLock lock(state.mutex);
+        while (state.finished.empty()) {
+            checkInterrupt();
+            /* Shouldn't happen, but don't wait for results that will
+               never come. */
+            if (pool.hasFailed()) {
+                failed = true;
+                break;
+            }
+            struct timespec t;
+            clock_gettime(CLOCK_REALTIME, &t);
+            t.tv_sec++;
+            pthread_cond_timedwait(&state.available, &state.mutex, &t);
+        }
+        finished.swap(state.finished);
+    }
+
+    /* Rethrow the error, without holding the lock that the workers
+       need to finish. */
+    if (failed) pool.process();
+
+    foreach (std::list<HashFileResult>::iterator, i, finished) {
+        state.pending--;
+        if (i->interrupted) {
+            checkInterrupt();
+            throw Interrupted("interrupted by the user");
+        }
+        if (i->error != "") throw Error(i->error);
+        stats.filesHashed++;
+        stats.bytesHashed += i->st.st_size;
+        optimiseFile_(stats, i->path, i->st, i->hash, &state);
+    }
+
+    struct timeval now;
+    gettimeofday(&now, 0);
+    stats.seconds = now.tv_sec - state.start.tv_sec
+        + (now.tv_usec - state.start.tv_usec) / 1000000.0;
+
+    if (now.tv_sec >= state.lastReport + 5) {
+        state.lastReport = now.tv_sec;
+        printMsg(lvlInfo, format("hashed %1% files (%2$.1f MiB, %3$.1f MiB/s)")
+            % stats.filesHashed % (stats.bytesHashed / (1024.0 * 1024.0))
+            % (stats.bytesHashed / (1024.0 * 1024.0) / stats.seconds));
+    }
+}
+
+
+/* Share the blocks of `path' with those of an earlier file with the
+   same contents.  Unlike hard-linking, this changes neither the inode
+   nor the link count of either file, so there is nothing for the
+   garbage collector to race with.  The earlier file is found through
+   a symlink to it in the reflinks directory. */
+void LocalStore::shareFile_(OptimiseStats & stats, const Path & path,
+    const struct stat & st, const Hash & hash)
+{
+    if (!S_ISREG(st.st_mode)) return;
+
+    stats.totalFiles++;
+    printMsg(lvlDebug, format("`%1%' has hash `%2%'") % path % printHash(hash));
+
+    Path linkPath = reflinksDir + "/" + printHash32(hash);
+
+    /* The symlink may be dangling if the earlier file has been
+       garbage-collected. */
+    Path source;
+    struct stat stLink, stSource;
+    bool found = false;
+    if (lstat(linkPath.c_str(), &stLink) == 0) {
+        source = readLink(linkPath);
+        found = lstat(source.c_str(), &stSource) == 0
+            && S_ISREG(stSource.st_mode) && stSource.st_size == st.st_size;
+    } else if (errno != ENOENT)
+        throw SysError(format("getting attributes of path `%1%'") % linkPath);
+
+    if (!found) {
+        /* Make `path' the file that later ones share their blocks
+           with, atomically replacing any dangling symlink. */
+        createDirs(reflinksDir);
+        Path tempLink = (format("%1%/.tmp-link-%2%-%3%")
+            % reflinksDir % getpid() % rand()).str();
+        if (symlink(path.c_str(), tempLink.c_str()) == -1)
+            throw SysError(format("creating symlink `%1%'") % tempLink);
+        if (rename(tempLink.c_str(), linkPath.c_str()) == -1)
+            throw SysError(format("cannot rename `%1%' to `%2%'") % tempLink % linkPath);
+        return;
+    }
+
+    stats.sameContents++;
+    if (st.st_dev == stSource.st_dev && st.st_ino == stSource.st_ino) return;
+
+    printMsg(lvlTalkative, format("sharing the blocks of `%1%' with `%2%'") % path % source);
+
+    makeMutable(path);
+
+    unsigned long long shared = dedupeFile(source, path, st.st_size);
+    if (shared) {
+        stats.filesShared++;
+        stats.bytesShared += shared;
+    }
+}
+
+
 void LocalStore::optimiseStore(OptimiseStats & stats)
 {
-    PathSet paths = queryAllValidPaths();
+    OptimisedPaths paths = queryOptimisedPaths(), done;
+
+    OptimiseState state;
+    readLinks(linksDir, state);
+
+    ThreadPool pool(settings.optimiseThreads);
+
+    Paths optimised;
+
+    foreach (OptimisedPaths::iterator, i, paths) {
+        const Path & path(i->first);
+        addTempRoot(path);
+        if (!isValidPath(path)) continue; /* path was GC'ed, probably */
+
+        /* Store paths are immutable, so if an earlier run finished
+           with this path and it hasn't been replaced since, there is
+           nothing to do.  Later duplicates of its files are linked
+           when the paths containing them are optimised. */
+        struct stat st;
+        if (lstat(path.c_str(), &st))
+            throw SysError(format("getting attributes of path `%1%'") % path);
+        if (st.st_ino == i->second) {
+            stats.pathsSkipped++;
+            continue;
+        }
+
+        startNest(nest, lvlChatty, format("hashing files in `%1%'") % path);
+        optimiseTree_(stats, path, st, pool, state);
+        optimised.push_back(path);
+    }
 
-    foreach (PathSet::iterator, i, paths) {
-        addTempRoot(*i);
-        if (!isValidPath(*i)) continue; /* path was GC'ed, probably */
-        startNest(nest, lvlChatty, format("hashing files in `%1%'") % *i);
-        optimisePath_(stats, *i);
+    while (state.pending) linkHashedFiles(stats, state, pool);
+    pool.process();
+
+    /* Record the inodes after linking: a path consisting of a single
+       file has been replaced by a link to `.links' by now. */
+    foreach (Paths::iterator, i, optimised) {
+        struct stat st;
+        if (lstat(i->c_str(), &st) == 0) done[*i] = st.st_ino;
     }
+
+    markOptimised(done);
 }
 
 
 void LocalStore::optimisePath(const Path & path)
 {
+    if (!settings.autoOptimiseStore) return;
     OptimiseStats stats;
-    if (settings.autoOptimiseStore) optimisePath_(stats, path);
+    struct stat st;
+    if (lstat(path.c_str(), &st))
+        throw SysError(format("getting attributes of path `%1%'") % path);
+    optimisePath_(stats, path, st);
+}
+
+
+void LocalStore::optimisePath(const Path & path, FileHashSink & fileHashes)
+{
+    if (!settings.autoOptimiseStore) return;
+
+    fileHashes.finish();
+
+    OptimiseStats stats;
+    foreach (FileHashSink::Hashes::iterator, i, fileHashes.hashes) {
+        checkInterrupt();
+        Path p = path + i->first;
+        struct stat st;
+        if (lstat(p.c_str(), &st))
+            throw SysError(format("getting attributes of path `%1%'") % p);
+#if !CAN_LINK_SYMLINK
+        if (S_ISLNK(st.st_mode)) continue;
+#endif
+        if (!isSuspicious(p, st)) optimiseFile_(stats, p, st, i->second);
+    }
+}
+
+
+HashResult LocalStore::hashAndOptimisePath(const Path & path)
+{
+    HashSink sink(htSHA256);
+    FileHashSink fileHashes(settings.autoOptimiseStore);
+    dumpPath(path, sink, fileHashes);
+    HashResult hash = sink.finish();
+    optimisePath(path, fileHashes);
+    return hash;
 }
 
 
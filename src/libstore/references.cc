@@ -5,44 +5,214 @@
 
 #include <map>
 #include <cstdlib>
+#include <cstring>
+
+#if __AVX2__
+#include <immintrin.h>
+#elif __SSE2__
+#include <emmintrin.h>
+#endif
 
 
 namespace nix {
 
 
-static unsigned int refLength = 32; /* characters */
+static const unsigned int refLength = 32; /* characters */
+
 
+static bool isBase32[256];
 
-static void search(const unsigned char * s, unsigned int len, 
-    StringSet & hashes, StringSet & seen)
+static void initBase32()
 {
     static bool initialised = false;
-    static bool isBase32[256];
-    if (!initialised) {
-        for (unsigned int i = 0; i < 256; ++i) isBase32[i] = false;
-        for (unsigned int i = 0; i < base32Chars.size(); ++i)
-            isBase32[(unsigned char) base32Chars[i]] = true;
-        initialised = true;
+    if (initialised) return;
+    for (unsigned int i = 0; i < 256; ++i) isBase32[i] = false;
+    for (unsigned int i = 0; i < base32Chars.size(); ++i)
+        isBase32[(unsigned char) base32Chars[i]] = true;
+    initialised = true;
+}
+
+
+/* The hash parts we're looking for, in an open-addressing table keyed
+   on their raw characters so that probing a candidate doesn't
+   allocate. */
+struct RefTable
+{
+    struct Entry
+    {
+        unsigned char key[refLength];
+        bool used;
+        bool found;
+    };
+
+    vector<Entry> entries;
+    size_t mask, count;
+
+    RefTable() : count(0) { resize(16); }
+
+    void insert(const string & s);
+
+    /* Return the entry for the `refLength' characters at `s', or 0 if
+       there is none. */
+    Entry * find(const unsigned char * s)
+    {
+        Entry & e = entries[probe(s)];
+        return e.used ? &e : 0;
     }
-    
-    for (unsigned int i = 0; i + refLength <= len; ) {
-        int j;
-        bool match = true;
-        for (j = refLength - 1; j >= 0; --j)
-            if (!isBase32[(unsigned char) s[i + j]]) {
-                i += j + 1;
-                match = false;
-                break;
-            }
-        if (!match) continue;
-        string ref((const char *) s + i, refLength);
-        if (hashes.find(ref) != hashes.end()) {
+
+private:
+    /* Return the slot holding `s', or the empty slot where it would
+       go. */
+    size_t probe(const unsigned char * s) const
+    {
+        unsigned long long h;
+        memcpy(&h, s, sizeof h);
+        size_t i = (h * 0x9e3779b97f4a7c15ULL) >> 32 & mask;
+        while (entries[i].used && memcmp(entries[i].key, s, refLength) != 0)
+            i = (i + 1) & mask;
+        return i;
+    }
+
+    void resize(size_t size);
+};
+
+
+void RefTable::resize(size_t size)
+{
+    vector<Entry> old;
+    old.swap(entries);
+    Entry empty;
+    empty.used = empty.found = false;
+    entries.resize(size, empty);
+    mask = size - 1;
+    foreach (vector<Entry>::iterator, i, old)
+        if (i->used) entries[probe(i->key)] = *i;
+}
+
+
+void RefTable::insert(const string & s)
+{
+    assert(s.size() == refLength);
+
+    /* Keep the load factor at most 1/2, so that probe sequences stay
+       short and there is always an empty slot. */
+    if (2 * (count + 1) > entries.size()) resize(entries.size() * 2);
+
+    Entry & e = entries[probe((const unsigned char *) s.data())];
+    if (e.used) return;
+    memcpy(e.key, s.data(), refLength);
+    e.used = true;
+    count++;
+}
+
+
+/* Look up every window of `refLength' characters in the run of base-32
+   characters s[start..end). */
+static void searchRun(const unsigned char * s, size_t start, size_t end,
+    RefTable & table, StringSet & seen)
+{
+    for (size_t i = start; i + refLength <= end; ++i) {
+        RefTable::Entry * e = table.find(s + i);
+        if (e && !e->found) {
+            string ref((const char *) s + i, refLength);
             debug(format("found reference to `%1%' at offset `%2%'")
                   % ref % i);
             seen.insert(ref);
-            hashes.erase(ref);
+            e->found = true;
         }
-        ++i;
+    }
+}
+
+
+/* Return the position of the last non-base-32 character among the
+   `refLength' characters at `p', or -1 if there is none.  In binary
+   data the last character usually settles it, so that is checked
+   first.  Otherwise, where the CPU allows, the characters are
+   classified a block at a time.  The base-32 characters are 0-9 and
+   a-z except e, o, t and u; since they are all ASCII, signed byte
+   comparisons are safe. */
+#if __AVX2__
+
+static inline int lastNonBase32(const unsigned char * p)
+{
+    if (!isBase32[p[refLength - 1]]) return refLength - 1;
+    __m256i c = _mm256_loadu_si256((const __m256i *) p);
+    __m256i digit = _mm256_and_si256(
+        _mm256_cmpgt_epi8(c, _mm256_set1_epi8('0' - 1)),
+        _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), c));
+    __m256i lower = _mm256_and_si256(
+        _mm256_cmpgt_epi8(c, _mm256_set1_epi8('a' - 1)),
+        _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), c));
+    __m256i excluded = _mm256_or_si256(
+        _mm256_or_si256(
+            _mm256_cmpeq_epi8(c, _mm256_set1_epi8('e')),
+            _mm256_cmpeq_epi8(c, _mm256_set1_epi8('o'))),
+        _mm256_or_si256(
+            _mm256_cmpeq_epi8(c, _mm256_set1_epi8('t')),
+            _mm256_cmpeq_epi8(c, _mm256_set1_epi8('u'))));
+    unsigned int bad = ~(unsigned int) _mm256_movemask_epi8(
+        _mm256_or_si256(digit, _mm256_andnot_si256(excluded, lower)));
+    return bad ? 31 - __builtin_clz(bad) : -1;
+}
+
+#elif __SSE2__
+
+static inline unsigned int nonBase32Mask(const unsigned char * p)
+{
+    __m128i c = _mm_loadu_si128((const __m128i *) p);
+    __m128i digit = _mm_and_si128(
+        _mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)),
+        _mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1)));
+    __m128i lower = _mm_and_si128(
+        _mm_cmpgt_epi8(c, _mm_set1_epi8('a' - 1)),
+        _mm_cmplt_epi8(c, _mm_set1_epi8('z' + 1)));
+    __m128i excluded = _mm_or_si128(
+        _mm_or_si128(
+            _mm_cmpeq_epi8(c, _mm_set1_epi8('e')),
+            _mm_cmpeq_epi8(c, _mm_set1_epi8('o'))),
+        _mm_or_si128(
+            _mm_cmpeq_epi8(c, _mm_set1_epi8('t')),
+            _mm_cmpeq_epi8(c, _mm_set1_epi8('u'))));
+    return ~_mm_movemask_epi8(
+        _mm_or_si128(digit, _mm_andnot_si128(excluded, lower))) & 0xffff;
+}
+
+static inline int lastNonBase32(const unsigned char * p)
+{
+    if (!isBase32[p[refLength - 1]]) return refLength - 1;
+    unsigned int bad;
+    if ((bad = nonBase32Mask(p + 16))) return 16 + 31 - __builtin_clz(bad);
+    if ((bad = nonBase32Mask(p))) return 31 - __builtin_clz(bad);
+    return -1;
+}
+
+#else
+
+static inline int lastNonBase32(const unsigned char * p)
+{
+    for (int j = refLength - 1; j >= 0; --j)
+        if (!isBase32[p[j]]) return j;
+    return -1;
+}
+
+#endif
+
+
+/* Find the runs of at least `refLength' base-32 characters in `s' and
+   look up the candidate hashes in them.  Most data has few such runs,
+   so this is dominated by skipping over the rest: checking the end of
+   each window first usually lets us skip a whole window at once. */
+static void search(const unsigned char * s, size_t len,
+    RefTable & table, StringSet & seen)
+{
+    size_t i = 0;
+    while (i + refLength <= len) {
+        int bad = lastNonBase32(s + i);
+        if (bad >= 0) { i += bad + 1; continue; }
+        size_t end = i + refLength;
+        while (end < len && isBase32[s[end]]) end++;
+        searchRun(s, i, end, table, seen);
+        i = end + 1;
     }
 }
 
@@ -50,12 +220,15 @@ static void search(const unsigned char * s, unsigned int len,
 struct RefScanSink : Sink
 {
     HashSink hashSink;
-    StringSet hashes;
+    RefTable table;
     StringSet seen;
 
-    string tail;
+    /* The last refLength - 1 bytes of the previous fragment, followed
+       by room for the first refLength - 1 bytes of the next. */
+    unsigned char tail[2 * refLength];
+    size_t tailLen;
 
-    RefScanSink() : hashSink(htSHA256) { }
+    RefScanSink() : hashSink(htSHA256), tailLen(0) { initBase32(); }
     
     void operator () (const unsigned char * data, size_t len);
 };
@@ -68,20 +241,37 @@ void RefScanSink::operator () (const unsigned char * data, size_t len)
     /* It's possible that a reference spans the previous and current
        fragment, so search in the concatenation of the tail of the
        previous fragment and the start of the current fragment. */
-    string s = tail + string((const char *) data, len > refLength ? refLength : len);
-    search((const unsigned char *) s.data(), s.size(), hashes, seen);
+    size_t headLen = len < refLength - 1 ? len : refLength - 1;
+    if (tailLen) {
+        memcpy(tail + tailLen, data, headLen);
+        search(tail, tailLen + headLen, table, seen);
+    }
 
-    search(data, len, hashes, seen);
+    search(data, len, table, seen);
 
-    unsigned int tailLen = len <= refLength ? len : refLength;
-    tail =
-        string(tail, tail.size() < refLength - tailLen ? 0 : tail.size() - (refLength - tailLen)) +
-        string((const char *) data + len - tailLen, tailLen);
+    /* Keep the last refLength - 1 bytes seen so far. */
+    if (len >= refLength - 1) {
+        memcpy(tail, data + len - (refLength - 1), refLength - 1);
+        tailLen = refLength - 1;
+    } else {
+        size_t keep = tailLen + len > refLength - 1 ? refLength - 1 - len : tailLen;
+        memmove(tail, tail + tailLen - keep, keep);
+        memcpy(tail + keep, data, len);
+        tailLen = keep + len;
+    }
 }
 
 
 PathSet scanForReferences(const string & path,
     const PathSet & refs, HashResult & hash)
+{
+    ParseSink parseSink; /* null sink */
+    return scanForReferences(path, refs, hash, parseSink);
+}
+
+
+PathSet scanForReferences(const string & path,
+    const PathSet & refs, HashResult & hash, ParseSink & parseSink)
 {
     RefScanSink sink;
     std::map<string, Path> backMap;
@@ -98,12 +288,12 @@ PathSet scanForReferences(const string & path,
         assert(s.size() == refLength);
         assert(backMap.find(s) == backMap.end());
         // parseHash(htSHA256, s);
-        sink.hashes.insert(s);
+        sink.table.insert(s);
         backMap[s] = *i;
     }
 
     /* Look for the hashes in the NAR dump of the path. */
-    dumpPath(path, sink);
+    dumpPath(path, sink, parseSink);
 
     /* Map the hashes found back to their store paths. */
     PathSet found;
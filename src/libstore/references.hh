@@ -2,10 +2,15 @@
 
 #include "types.hh"
 #include "hash.hh"
+#include "archive.hh"
 
 namespace nix {
 
 PathSet scanForReferences(const Path & path, const PathSet & refs,
     HashResult & hash);
+
+/* Likewise, but also replay the NAR of `path' to `parseSink'. */
+PathSet scanForReferences(const Path & path, const PathSet & refs,
+    HashResult & hash, ParseSink & parseSink);
     
 }
@@ -322,6 +322,46 @@ void RemoteStore::queryReferrers(const Path & path,
 }
 
 
+void RemoteStore::queryClosure(const PathSet & paths, PathSet & closure,
+    bool flipDirection, bool includeOutputs)
+{
+    openConnection();
+    if (GET_PROTOCOL_MINOR(daemonVersion) < 14) {
+        StoreAPI::queryClosure(paths, closure, flipDirection, includeOutputs);
+        return;
+    }
+    PathSet todo;
+    foreach (PathSet::const_iterator, i, paths)
+        if (closure.find(*i) == closure.end()) todo.insert(*i);
+    if (todo.empty()) return;
+    writeInt(wopQueryClosure, to);
+    writeStrings(todo, to);
+    writeInt(flipDirection ? 1 : 0, to);
+    writeInt(includeOutputs ? 1 : 0, to);
+    processStderr();
+    PathSet closure2 = readStorePaths<PathSet>(from);
+    closure.insert(closure2.begin(), closure2.end());
+}
+
+
+void RemoteStore::queryBuildTimes(const PathSet & drvPaths, BuildTimes & times)
+{
+    openConnection();
+    if (GET_PROTOCOL_MINOR(daemonVersion) < 16) return;
+    writeInt(wopQueryBuildTimes, to);
+    writeStrings(drvPaths, to);
+    processStderr();
+    unsigned int count = readInt(from);
+    for (unsigned int n = 0; n < count; n++) {
+        Path drvPath = readStorePath(from);
+        BuildTime & time(times[drvPath]);
+        time.duration = readLongLong(from);
+        time.outputSize = readLongLong(from);
+        time.buildCores = readInt(from);
+    }
+}
+
+
 Path RemoteStore::queryDeriver(const Path & path)
 {
     openConnection();
@@ -375,6 +415,29 @@ Path RemoteStore::addToStore(const Path & _srcPath,
 
     Path srcPath(absPath(_srcPath));
 
+    if (GET_PROTOCOL_MINOR(daemonVersion) >= 13) {
+        /* Send the hash of the contents first, so that the daemon
+           can tell us whether the path is already valid, in which
+           case we don't have to upload anything. */
+        Hash h = recursive
+            ? hashPath(hashAlgo, srcPath, filter).first
+            : hashFile(hashAlgo, srcPath);
+        writeInt(wopAddToStoreNar, to);
+        writeString(baseNameOf(srcPath), to);
+        writeInt(recursive ? 1 : 0, to);
+        writeString(printHashType(hashAlgo), to);
+        writeString(printHash(h), to);
+        processStderr();
+        Path path = readString(from);
+        if (path != "") {
+            assertStorePath(path);
+            return path;
+        }
+        dumpPath(srcPath, to, filter);
+        processStderr();
+        return readStorePath(from);
+    }
+
     writeInt(wopAddToStore, to);
     writeString(baseNameOf(srcPath), to);
     /* backwards compatibility hack */
@@ -507,6 +570,11 @@ void RemoteStore::collectGarbage(const GCOptions & options, GCResults & results)
         writeInt(0, to);
         writeInt(0, to);
     }
+    if (GET_PROTOCOL_MINOR(daemonVersion) >= 15) {
+        writeLongLong(options.minFree, to);
+        writeInt(options.order, to);
+    } else if (options.minFree != 0 || options.order != GCOptions::gcOrderRandom)
+        throw Error("the daemon is too old to support `--min-free' or `--order'");
 
     processStderr();
 
@@ -38,6 +38,9 @@ public:
 
     void queryReferrers(const Path & path, PathSet & referrers);
 
+    void queryClosure(const PathSet & paths, PathSet & closure,
+        bool flipDirection = false, bool includeOutputs = false);
+
     Path queryDeriver(const Path & path);
     
     PathSet queryDerivationOutputs(const Path & path);
@@ -45,6 +48,8 @@ public:
     StringSet queryDerivationOutputNames(const Path & path);
 
     Path queryPathFromHashPart(const string & hashPart);
+
+    void queryBuildTimes(const PathSet & drvPaths, BuildTimes & times);
     
     PathSet querySubstitutablePaths(const PathSet & paths);
     
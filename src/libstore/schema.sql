@@ -42,3 +42,40 @@ create table if not exists FailedPaths (
     path text primary key not null,
     time integer not null
 );
+
+-- The outcome of the last content check of each valid path, used by
+-- `nix-store --verify --check-contents' to check the least recently
+-- verified paths first.
+create table if not exists VerifiedPaths (
+    id   integer primary key not null,
+    time integer not null, -- when the contents were last checked
+    good integer not null, -- whether they matched the hash at that time
+    foreign key (id) references ValidPaths(id) on delete cascade
+);
+
+create index if not exists IndexVerifiedPathsTime on VerifiedPaths(time);
+
+-- The paths that `nix-store --optimise' has finished with, so that
+-- later runs can skip them.  `inode' is the inode of the path at that
+-- time; if the path has been replaced since (e.g. by a repair), it's
+-- optimised again.
+create table if not exists OptimisedPaths (
+    id    integer primary key not null,
+    inode integer not null,
+    foreign key (id) references ValidPaths(id) on delete cascade
+);
+
+-- The last successful local build of each derivation, keyed on its
+-- name without the version and its system type, so that a new version
+-- of a package is expected to take about as long as the old one.  Used
+-- to start long builds early and to estimate how long a build will
+-- take.
+create table if not exists BuildTimes (
+    name       text not null,
+    system     text not null,
+    duration   integer not null, -- wall-clock time in seconds
+    outputSize integer not null, -- NAR size of all outputs
+    buildCores integer not null, -- value of NIX_BUILD_CORES
+    time       integer not null, -- when the build finished
+    primary key (name, system)
+);
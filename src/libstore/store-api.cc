@@ -1,6 +1,7 @@
 #include "store-api.hh"
 #include "globals.hh"
 #include "util.hh"
+#include "derivations.hh"
 
 #include <climits>
 
@@ -13,6 +14,8 @@ GCOptions::GCOptions()
     action = gcDeleteDead;
     ignoreLiveness = false;
     maxFreed = ULLONG_MAX;
+    minFree = 0;
+    order = gcOrderRandom;
 }
 
 
@@ -230,6 +233,41 @@ Path computeStorePathForText(const string & name, const string & s,
 }
 
 
+void StoreAPI::queryClosure(const PathSet & paths, PathSet & closure,
+    bool flipDirection, bool includeOutputs)
+{
+    PathSet todo;
+    foreach (PathSet::const_iterator, i, paths)
+        if (closure.find(*i) == closure.end()) todo.insert(*i);
+
+    while (!todo.empty()) {
+        Path path = *todo.begin();
+        todo.erase(todo.begin());
+        if (!closure.insert(path).second) continue;
+
+        PathSet next;
+        if (flipDirection)
+            queryReferrers(path, next);
+        else
+            queryReferences(path, next);
+
+        if (includeOutputs && isDerivation(path)) {
+            PathSet outputs = queryDerivationOutputs(path);
+            foreach (PathSet::iterator, i, outputs)
+                if (isValidPath(*i)) next.insert(*i);
+        }
+
+        foreach (PathSet::iterator, i, next)
+            if (closure.find(*i) == closure.end()) todo.insert(*i);
+    }
+}
+
+
+void StoreAPI::queryBuildTimes(const PathSet & drvPaths, BuildTimes & times)
+{
+}
+
+
 /* Return a string accepted by decodeValidPathInfo() that
    registers the specified paths as valid.  Note: it's the
    responsibility of the caller to provide a closure. */
@@ -51,6 +51,33 @@ struct GCOptions
     /* Stop after at least `maxFreed' bytes have been freed. */
     unsigned long long maxFreed;
 
+    /* Stop once the file system containing the store has at least
+       `minFree' bytes available.  0 means there is no such target. */
+    unsigned long long minFree;
+
+    /* The order in which dead paths are deleted, which determines
+       what is kept when `maxFreed' or `minFree' stops the collector
+       early:
+
+       - `gcOrderRandom': random order.
+
+       - `gcOrderOldest': least recently registered paths first.
+
+       - `gcOrderLargest': paths with the largest NAR serialisation
+         first, so that a target is reached with as few deletions as
+         possible.
+
+       - `gcOrderAtime': least recently accessed paths first.
+    */
+    typedef enum {
+        gcOrderRandom,
+        gcOrderOldest,
+        gcOrderLargest,
+        gcOrderAtime,
+    } GCOrder;
+
+    GCOrder order;
+
     GCOptions();
 };
 
@@ -83,6 +110,19 @@ struct SubstitutablePathInfo
 typedef std::map<Path, SubstitutablePathInfo> SubstitutablePathInfos;
 
 
+/* What is known about the last local build of a derivation with the
+   same name (ignoring the version) and system type. */
+struct BuildTime
+{
+    time_t duration; /* wall-clock time in seconds */
+    unsigned long long outputSize; /* NAR size of all outputs */
+    unsigned int buildCores; /* value of NIX_BUILD_CORES */
+    BuildTime() : duration(0), outputSize(0), buildCores(0) { }
+};
+
+typedef std::map<Path, BuildTime> BuildTimes;
+
+
 struct ValidPathInfo 
 {
     Path path;
@@ -129,6 +169,16 @@ public:
     virtual void queryReferrers(const Path & path,
         PathSet & referrers) = 0;
 
+    /* Add the closure of `paths' under the references relation to
+       `closure', or under the referrers relation if `flipDirection'
+       is set.  If `includeOutputs' is set, the valid outputs of
+       derivations in the closure are included as well.  Paths that
+       are already in `closure' are assumed to have their closure in
+       it too.  The default implementation queries one path at a
+       time. */
+    virtual void queryClosure(const PathSet & paths, PathSet & closure,
+        bool flipDirection = false, bool includeOutputs = false);
+
     /* Query the deriver of a store path.  Return the empty string if
        no deriver has been set. */
     virtual Path queryDeriver(const Path & path) = 0;
@@ -143,6 +193,11 @@ public:
        path, or "" if the path doesn't exist. */
     virtual Path queryPathFromHashPart(const string & hashPart) = 0;
     
+    /* Look up the last build of each of the given derivations (see
+       BuildTime), and add those that have been built before to
+       `times'.  The default implementation knows of no builds. */
+    virtual void queryBuildTimes(const PathSet & drvPaths, BuildTimes & times);
+
     /* Query which of the given paths have substitutes. */
     virtual PathSet querySubstitutablePaths(const PathSet & paths) = 0;
 
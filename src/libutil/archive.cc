@@ -3,6 +3,7 @@
 #include <cerrno>
 #include <algorithm>
 #include <vector>
+#include <memory>
 
 #define _XOPEN_SOURCE 600
 #include <sys/types.h>
@@ -13,6 +14,7 @@
 
 #include "archive.hh"
 #include "util.hh"
+#include "thread-pool.hh"
 
 
 namespace nix {
@@ -24,41 +26,126 @@ static string archiveVersion1 = "nix-archive-1";
 PathFilter defaultPathFilter;
 
 
-static void dump(const string & path, Sink & sink, PathFilter & filter);
+unsigned int dumpReadAheadThreads = 0;
 
 
-static void dumpEntries(const Path & path, Sink & sink, PathFilter & filter)
+/* Files larger than this are read with sequential access advice
+   rather than being prefetched in full. */
+static const off_t readAheadMax = 4 * 1024 * 1024;
+
+/* Maximum number of directory entries to prefetch ahead of the entry
+   currently being dumped. */
+static const unsigned int readAheadWindow = 32;
+
+
+/* Ask the kernel to start reading `path' into the page cache, so that
+   the dumper doesn't have to wait for it.  For directories, this
+   fetches the inodes of the entries.  Errors are ignored, since the
+   dumper will report them. */
+struct PrefetchWork : ThreadPool::Work
 {
-    Strings names = readDirectory(path);
-    vector<string> names2(names.begin(), names.end());
-    sort(names2.begin(), names2.end());
+    Path path;
+
+    PrefetchWork(const Path & path) : path(path) { }
 
-    for (vector<string>::iterator i = names2.begin();
-         i != names2.end(); ++i)
+    void run()
     {
-        Path entry = path + "/" + *i;
-        if (filter(entry)) {
-            writeString("entry", sink);
-            writeString("(", sink);
-            writeString("name", sink);
-            writeString(*i, sink);
-            writeString("node", sink);
-            dump(entry, sink, filter);
-            writeString(")", sink);
+        struct stat st;
+        if (lstat(path.c_str(), &st)) return;
+
+        if (S_ISREG(st.st_mode) && st.st_size > 0) {
+#ifdef POSIX_FADV_WILLNEED
+            /* Not AutoCloseFD, which may print messages. */
+            int fd = open(path.c_str(), O_RDONLY);
+            if (fd == -1) return;
+            posix_fadvise(fd, 0, st.st_size > readAheadMax ? readAheadMax : st.st_size,
+                POSIX_FADV_WILLNEED);
+            close(fd);
+#endif
+        }
+
+        else if (S_ISDIR(st.st_mode)) {
+            AutoCloseDir dir = opendir(path.c_str());
+            if (!dir) return;
+            struct dirent * dirent;
+            while ((dirent = readdir(dir)))
+                fstatat(dirfd(dir), dirent->d_name, &st, AT_SYMLINK_NOFOLLOW);
         }
     }
+};
+
+
+struct Dumper
+{
+    Sink & sink;
+    ParseSink & parseSink;
+    PathFilter & filter;
+
+    /* Threads that prefetch the entries of the directory being
+       dumped.  Created when the first directory is encountered. */
+    std::auto_ptr<ThreadPool> pool;
+
+    Dumper(Sink & sink, ParseSink & parseSink, PathFilter & filter)
+        : sink(sink), parseSink(parseSink), filter(filter) { }
+
+    void dump(int dirFd, const string & name, const Path & path, const Path & relPath);
+    void dumpEntries(DirIterator & dir, const Path & path, const Path & relPath);
+    void dumpContents(int dirFd, const string & name, const Path & path, size_t size);
+};
+
+
+void Dumper::dumpEntries(DirIterator & dir, const Path & path, const Path & relPath)
+{
+    vector<string> names2;
+    while (dir.next()) names2.push_back(dir.name());
+    sort(names2.begin(), names2.end());
+
+    /* Apply the filter first, so that we know which entries to
+       prefetch. */
+    vector<string> entries;
+    foreach (vector<string>::iterator, i, names2)
+        if (filter(path + "/" + *i)) entries.push_back(*i);
+
+    if (!pool.get() && dumpReadAheadThreads && entries.size() > 1)
+        pool.reset(new ThreadPool(dumpReadAheadThreads));
+
+    /* The NAR is always written in the same order by this thread;
+       the pool only warms the page cache for the next few entries. */
+    unsigned int prefetched = 0;
+
+    for (unsigned int n = 0; n < entries.size(); ++n) {
+        if (pool.get())
+            while (prefetched < entries.size() && prefetched < n + readAheadWindow)
+                pool->enqueue(new PrefetchWork(path + "/" + entries[prefetched++]));
+
+        writeString("entry", sink);
+        writeString("(", sink);
+        writeString("name", sink);
+        writeString(entries[n], sink);
+        writeString("node", sink);
+        dump(dir.fd(), entries[n], path + "/" + entries[n], relPath + "/" + entries[n]);
+        writeString(")", sink);
+    }
 }
 
 
-static void dumpContents(const Path & path, size_t size, 
-    Sink & sink)
+void Dumper::dumpContents(int dirFd, const string & name, const Path & path, size_t size)
 {
     writeString("contents", sink);
     writeLongLong(size, sink);
 
-    AutoCloseFD fd = open(path.c_str(), O_RDONLY);
+    AutoCloseFD fd = openat(dirFd, name.c_str(), O_RDONLY);
     if (fd == -1) throw SysError(format("opening file `%1%'") % path);
-    
+
+#ifdef POSIX_FADV_SEQUENTIAL
+    /* For large files, let the kernel use a bigger read-ahead
+       window. */
+    if (size > (size_t) readAheadMax)
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    parseSink.preallocateContents(size);
+
     unsigned char buf[65536];
     size_t left = size;
 
@@ -67,16 +154,25 @@ static void dumpContents(const Path & path, size_t size,
         readFull(fd, buf, n);
         left -= n;
         sink(buf, n);
+        parseSink.receiveContents(buf, n);
     }
 
     writePadding(size, sink);
 }
 
 
-static void dump(const Path & path, Sink & sink, PathFilter & filter)
+/* Serialise `path' to `sink'.  At the same time, replay the
+   serialisation to `parseSink' exactly as parseDump() would, using
+   `relPath' as the name of `path' within the archive.  The file is
+   accessed as `name' relative to the open directory `dirFd', which
+   saves the kernel from resolving the full path of every entry;
+   `path' is only used in error messages and for the filter. */
+void Dumper::dump(int dirFd, const string & name, const Path & path, const Path & relPath)
 {
+    checkInterrupt();
+
     struct stat st;
-    if (lstat(path.c_str(), &st))
+    if (fstatat(dirFd, name.c_str(), &st, AT_SYMLINK_NOFOLLOW))
         throw SysError(format("getting attributes of path `%1%'") % path);
 
     writeString("(", sink);
@@ -84,24 +180,33 @@ static void dump(const Path & path, Sink & sink, PathFilter & filter)
     if (S_ISREG(st.st_mode)) {
         writeString("type", sink);
         writeString("regular", sink);
+        parseSink.createRegularFile(relPath);
         if (st.st_mode & S_IXUSR) {
             writeString("executable", sink);
             writeString("", sink);
+            parseSink.isExecutable();
         }
-        dumpContents(path, (size_t) st.st_size, sink);
-    } 
+        dumpContents(dirFd, name, path, (size_t) st.st_size);
+    }
 
     else if (S_ISDIR(st.st_mode)) {
         writeString("type", sink);
         writeString("directory", sink);
-        dumpEntries(path, sink, filter);
+        parseSink.createDirectory(relPath);
+        DirIterator dir(name, dirFd, O_NOFOLLOW);
+        dumpEntries(dir, path, relPath);
     }
 
     else if (S_ISLNK(st.st_mode)) {
+        char buf[st.st_size];
+        if (readlinkat(dirFd, name.c_str(), buf, st.st_size) != st.st_size)
+            throw SysError(format("reading symbolic link `%1%'") % path);
+        string target(buf, st.st_size);
         writeString("type", sink);
         writeString("symlink", sink);
         writeString("target", sink);
-        writeString(readLink(path), sink);
+        writeString(target, sink);
+        parseSink.createSymlink(relPath, target);
     }
 
     else throw Error(format("file `%1%' has an unknown type") % path);
@@ -112,8 +217,85 @@ static void dump(const Path & path, Sink & sink, PathFilter & filter)
 
 void dumpPath(const Path & path, Sink & sink, PathFilter & filter)
 {
+    ParseSink parseSink; /* null sink */
+    dumpPath(path, sink, parseSink, filter);
+}
+
+
+void dumpPath(const Path & path, Sink & sink, ParseSink & parseSink,
+    PathFilter & filter)
+{
+    writeString(archiveVersion1, sink);
+    Dumper(sink, parseSink, filter).dump(AT_FDCWD, path, path, "");
+}
+
+
+void FileHashSink::finish()
+{
+    if (!sink.get()) return;
+    writePadding(size, *sink);
+    writeString(")", *sink);
+    hashes[current] = sink->finish().first;
+    sink.reset();
+}
+
+
+void FileHashSink::createDirectory(const Path & path)
+{
+    finish();
+}
+
+
+void FileHashSink::createRegularFile(const Path & path)
+{
+    finish();
+    if (!enabled) return;
+    current = path;
+    size = 0;
+    sink.reset(new HashSink(htSHA256));
+    writeString(archiveVersion1, *sink);
+    writeString("(", *sink);
+    writeString("type", *sink);
+    writeString("regular", *sink);
+}
+
+
+void FileHashSink::isExecutable()
+{
+    if (!sink.get()) return;
+    writeString("executable", *sink);
+    writeString("", *sink);
+}
+
+
+void FileHashSink::preallocateContents(unsigned long long size)
+{
+    if (!sink.get()) return;
+    this->size = size;
+    writeString("contents", *sink);
+    writeLongLong(size, *sink);
+}
+
+
+void FileHashSink::receiveContents(unsigned char * data, unsigned int len)
+{
+    if (sink.get()) (*sink)(data, len);
+}
+
+
+void FileHashSink::createSymlink(const Path & path, const string & target)
+{
+    finish();
+    if (!enabled) return;
+    HashSink sink(htSHA256);
     writeString(archiveVersion1, sink);
-    dump(path, sink, filter);
+    writeString("(", sink);
+    writeString("type", sink);
+    writeString("symlink", sink);
+    writeString("target", sink);
+    writeString(target, sink);
+    writeString(")", sink);
+    hashes[path] = sink.finish().first;
 }
 
 
@@ -267,13 +449,90 @@ void parseDump(ParseSink & sink, Source & source)
 }
 
 
+unsigned int restoreThreads = 4;
+
+
+/* Regular files smaller than this are written by the parsing thread,
+   since handing them to a worker costs more than writing them. */
+static const unsigned long long parallelFileSize = 64 * 1024;
+
+/* Regular files at least this large are preallocated, and are written
+   by the parsing thread rather than being buffered for a worker. */
+static const unsigned long long largeFileSize = 16 * 1024 * 1024;
+
+/* Limits on the data and number of files buffered for the workers
+   before the parser waits for them to catch up. */
+static const unsigned long long maxBufferedBytes = 64 * 1024 * 1024;
+static const unsigned int maxBufferedFiles = 4096;
+
+
+static void makeExecutable(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+        throw SysError("fstat");
+    if (fchmod(fd, st.st_mode | (S_IXUSR | S_IXGRP | S_IXOTH)) == -1)
+        throw SysError("fchmod");
+}
+
+
+/* Create a regular file from contents buffered in memory. */
+struct WriteFileWork : ThreadPool::Work
+{
+    Path path;
+    bool executable;
+    string contents;
+
+    WriteFileWork(const Path & path) : path(path), executable(false) { }
+
+    void run()
+    {
+        AutoCloseFD fd = open(path.c_str(), O_CREAT | O_EXCL | O_WRONLY, 0666);
+        if (fd == -1) throw SysError(format("creating file `%1%'") % path);
+        if (executable) makeExecutable(fd);
+        writeFull(fd, (const unsigned char *) contents.data(), contents.size());
+        fd.close();
+    }
+};
+
+
 struct RestoreSink : ParseSink
 {
     Path dstPath;
     AutoCloseFD fd;
 
+    /* If set, medium-sized files are written by a thread pool, which
+       is created when the first such file is encountered. */
+    bool parallel;
+    std::auto_ptr<ThreadPool> pool;
+    std::auto_ptr<WriteFileWork> pending;
+    unsigned long long bufferedBytes;
+    unsigned int bufferedFiles;
+
+    RestoreSink() : parallel(false), bufferedBytes(0), bufferedFiles(0) { }
+
+    /* Hand the file being parsed to the workers. */
+    void flushPending()
+    {
+        if (!pending.get()) return;
+        bufferedBytes += pending->contents.size();
+        bufferedFiles++;
+        pool->enqueue(pending.release());
+        if (bufferedBytes >= maxBufferedBytes || bufferedFiles >= maxBufferedFiles)
+            finish();
+    }
+
+    /* Wait until all files have been written. */
+    void finish()
+    {
+        flushPending();
+        if (pool.get()) pool->process();
+        bufferedBytes = bufferedFiles = 0;
+    }
+
     void createDirectory(const Path & path)
     {
+        flushPending();
         Path p = dstPath + path;
         if (mkdir(p.c_str(), 0777) == -1)
             throw SysError(format("creating directory `%1%'") % p);
@@ -281,54 +540,151 @@ struct RestoreSink : ParseSink
 
     void createRegularFile(const Path & path)
     {
+        flushPending();
         Path p = dstPath + path;
+        /* We don't know the size yet, so decide in
+           preallocateContents() whether to write it ourselves. */
+        if (parallel) {
+            pending.reset(new WriteFileWork(p));
+            return;
+        }
         fd = open(p.c_str(), O_CREAT | O_EXCL | O_WRONLY, 0666);
         if (fd == -1) throw SysError(format("creating file `%1%'") % p);
     }
 
     void isExecutable()
     {
-        struct stat st;
-        if (fstat(fd, &st) == -1)
-            throw SysError("fstat");
-        if (fchmod(fd, st.st_mode | (S_IXUSR | S_IXGRP | S_IXOTH)) == -1)
-            throw SysError("fchmod");
+        if (pending.get())
+            pending->executable = true;
+        else
+            makeExecutable(fd);
     }
 
     void preallocateContents(unsigned long long len)
     {
-#if HAVE_POSIX_FALLOCATE
-        if (len) {
-            errno = posix_fallocate(fd, 0, len);
-            /* Note that EINVAL may indicate that the underlying
-               filesystem doesn't support preallocation (e.g. on
-               OpenSolaris).  Since preallocation is just an
-               optimisation, ignore it. */
-            if (errno && errno != EINVAL)
-                throw SysError(format("preallocating file of %1% bytes") % len);
+        if (pending.get() && len >= parallelFileSize && len < largeFileSize) {
+            if (!pool.get()) pool.reset(new ThreadPool(restoreThreads));
+            pending->contents.reserve(len);
+            return;
+        }
+
+        /* Small and large files are written directly. */
+        if (pending.get()) {
+            fd = open(pending->path.c_str(), O_CREAT | O_EXCL | O_WRONLY, 0666);
+            if (fd == -1) throw SysError(format("creating file `%1%'") % pending->path);
+            if (pending->executable) makeExecutable(fd);
+            pending.reset();
         }
+
+        if (len < largeFileSize) return;
+
+#if HAVE_POSIX_FALLOCATE
+        errno = posix_fallocate(fd, 0, len);
+        /* Note that EINVAL may indicate that the underlying
+           filesystem doesn't support preallocation (e.g. on
+           OpenSolaris).  Since preallocation is just an
+           optimisation, ignore it. */
+        if (errno && errno != EINVAL)
+            throw SysError(format("preallocating file of %1% bytes") % len);
 #endif
     }
 
     void receiveContents(unsigned char * data, unsigned int len)
     {
-        writeFull(fd, data, len);
+        if (pending.get())
+            pending->contents.append((const char *) data, len);
+        else
+            writeFull(fd, data, len);
     }
 
     void createSymlink(const Path & path, const string & target)
     {
+        flushPending();
         Path p = dstPath + path;
         if (symlink(target.c_str(), p.c_str()) == -1)
             throw SysError(format("creating symlink `%1%'") % p);
     }
 };
 
+
+/* A ParseSink that passes everything on to two others. */
+struct TeeParseSink : ParseSink
+{
+    ParseSink & a, & b;
+    TeeParseSink(ParseSink & a, ParseSink & b) : a(a), b(b) { }
+
+    void createDirectory(const Path & path)
+    {
+        a.createDirectory(path);
+        b.createDirectory(path);
+    }
+
+    void createRegularFile(const Path & path)
+    {
+        a.createRegularFile(path);
+        b.createRegularFile(path);
+    }
+
+    void isExecutable()
+    {
+        a.isExecutable();
+        b.isExecutable();
+    }
+
+    void preallocateContents(unsigned long long size)
+    {
+        a.preallocateContents(size);
+        b.preallocateContents(size);
+    }
+
+    void receiveContents(unsigned char * data, unsigned int len)
+    {
+        a.receiveContents(data, len);
+        b.receiveContents(data, len);
+    }
+
+    void createSymlink(const Path & path, const string & target)
+    {
+        a.createSymlink(path, target);
+        b.createSymlink(path, target);
+    }
+};
+
  
 void restorePath(const Path & path, Source & source)
+{
+    ParseSink parseSink; /* null sink */
+    restorePath(path, source, parseSink);
+}
+
+
+void restorePath(const Path & path, Source & source, ParseSink & parseSink)
 {
     RestoreSink sink;
     sink.dstPath = path;
-    parseDump(sink, source);
+    sink.parallel = restoreThreads != 1;
+    TeeParseSink tee(sink, parseSink);
+    parseDump(tee, source);
+    sink.finish();
+}
+
+
+void copyPath(const Path & from, const Path & to, Sink & sink,
+    PathFilter & filter)
+{
+    ParseSink parseSink; /* null sink */
+    copyPath(from, to, sink, parseSink, filter);
+}
+
+
+void copyPath(const Path & from, const Path & to, Sink & sink,
+    ParseSink & parseSink, PathFilter & filter)
+{
+    RestoreSink restoreSink;
+    restoreSink.dstPath = to;
+    TeeParseSink tee(restoreSink, parseSink);
+    writeString(archiveVersion1, sink);
+    Dumper(sink, tee, filter).dump(AT_FDCWD, from, from, "");
 }
 
  
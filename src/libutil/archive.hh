@@ -2,6 +2,10 @@
 
 #include "types.hh"
 #include "serialise.hh"
+#include "hash.hh"
+
+#include <map>
+#include <memory>
 
 
 namespace nix {
@@ -55,6 +59,12 @@ extern PathFilter defaultPathFilter;
 void dumpPath(const Path & path, Sink & sink,
     PathFilter & filter = defaultPathFilter);
 
+/* Number of threads that dumpPath() uses to prefetch the contents of
+   directory entries before they are serialised.  This doesn't affect
+   the output, only how long it takes to produce on a cold cache.  0
+   (the default) disables prefetching. */
+extern unsigned int dumpReadAheadThreads;
+
 struct ParseSink
 {
     virtual void createDirectory(const Path & path) { };
@@ -69,7 +79,64 @@ struct ParseSink
     
 void parseDump(ParseSink & sink, Source & source);
 
+/* Like dumpPath(), but also replay the archive to `parseSink' as
+   parseDump() would, so that a single traversal of `path' can feed
+   several consumers. */
+void dumpPath(const Path & path, Sink & sink, ParseSink & parseSink,
+    PathFilter & filter = defaultPathFilter);
+
+/* A ParseSink that computes, for every regular file and symlink in
+   the archive, the SHA-256 hash of its own NAR serialisation, i.e.
+   what hashPath() would return for it.  The keys of `hashes' are
+   relative to the root of the archive.  If `enabled' is false, it
+   does nothing. */
+struct FileHashSink : ParseSink
+{
+    typedef std::map<Path, Hash> Hashes;
+    Hashes hashes;
+
+    FileHashSink(bool enabled = true) : enabled(enabled), size(0) { }
+
+    void createDirectory(const Path & path);
+    void createRegularFile(const Path & path);
+    void isExecutable();
+    void preallocateContents(unsigned long long size);
+    void receiveContents(unsigned char * data, unsigned int len);
+    void createSymlink(const Path & path, const string & target);
+
+    /* Finish the hash of the last file.  Must be called after the
+       archive has been processed. */
+    void finish();
+
+private:
+    bool enabled;
+    Path current;
+    std::auto_ptr<HashSink> sink;
+    unsigned long long size;
+};
+
 void restorePath(const Path & path, Source & source);
 
+/* Like restorePath(), but also replay the archive to `parseSink'. */
+void restorePath(const Path & path, Source & source, ParseSink & parseSink);
+
+/* Number of threads that restorePath() uses to write medium-sized
+   files while the parser continues with the rest of the archive.
+   The threads are only started if the archive has such files.  0
+   means one per CPU core; 1 restores everything on the calling
+   thread.  The default is 4. */
+extern unsigned int restoreThreads;
+
+/* Copy `from' to `to', writing the Nix archive of `from' to `sink'
+   along the way.  This has the same effect as dumpPath() followed by
+   restorePath(), but the archive is never held in memory, so it can
+   be used to hash and copy arbitrarily large paths in one pass. */
+void copyPath(const Path & from, const Path & to, Sink & sink,
+    PathFilter & filter = defaultPathFilter);
+
+/* Like copyPath(), but also replay the archive to `parseSink'. */
+void copyPath(const Path & from, const Path & to, Sink & sink,
+    ParseSink & parseSink, PathFilter & filter = defaultPathFilter);
+
  
 }
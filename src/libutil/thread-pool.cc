@@ -0,0 +1,205 @@
+#include "config.h"
+
+#include "thread-pool.hh"
+#include "util.hh"
+
+#include <cerrno>
+#include <cstring>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+
+
+namespace nix {
+
+
+unsigned int getNrCores()
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n < 1 ? 1 : n;
+}
+
+
+ThreadPool::ThreadPool(unsigned int nrThreads)
+    : active(0), quit(false), failed(false), interrupted(false)
+{
+    if (nrThreads == 0) nrThreads = getNrCores();
+
+    pthread_mutex_init(&mutex, 0);
+    pthread_cond_init(&workAvailable, 0);
+    pthread_cond_init(&workDone, 0);
+
+    /* Block all signals in the worker threads, so that signals such
+       as SIGINT are always handled by the main thread. */
+    sigset_t set, oldSet;
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &oldSet);
+
+    for (unsigned int n = 0; n < nrThreads; ++n) {
+        pthread_t thread;
+        int err = pthread_create(&thread, 0, workerEntry, this);
+        if (err) {
+            pthread_sigmask(SIG_SETMASK, &oldSet, 0);
+            /* Run with the threads we have, if any. */
+            if (!threads.empty()) break;
+            errno = err;
+            throw SysError("creating worker thread");
+        }
+        threads.push_back(thread);
+    }
+
+    pthread_sigmask(SIG_SETMASK, &oldSet, 0);
+}
+
+
+ThreadPool::~ThreadPool()
+{
+    {
+        MutexLock lock(mutex);
+        clearQueue();
+        quit = true;
+        pthread_cond_broadcast(&workAvailable);
+    }
+
+    foreach (vector<pthread_t>::iterator, i, threads)
+        pthread_join(*i, 0);
+
+    pthread_cond_destroy(&workDone);
+    pthread_cond_destroy(&workAvailable);
+    pthread_mutex_destroy(&mutex);
+}
+
+
+void ThreadPool::clearQueue()
+{
+    foreach (std::list<Work *>::iterator, i, queue)
+        delete *i;
+    queue.clear();
+}
+
+
+void ThreadPool::enqueue(Work * work)
+{
+    MutexLock lock(mutex);
+    if (failed) {
+        delete work;
+        return;
+    }
+    queue.push_back(work);
+    pthread_cond_signal(&workAvailable);
+}
+
+
+void ThreadPool::process()
+{
+    MutexLock lock(mutex);
+
+    /* Wake up periodically to check whether we've been
+       interrupted. */
+    while (!queue.empty() || active) {
+        checkInterrupt();
+        struct timespec t;
+        clock_gettime(CLOCK_REALTIME, &t);
+        t.tv_nsec += 100 * 1000 * 1000;
+        if (t.tv_nsec >= 1000 * 1000 * 1000) {
+            t.tv_sec++;
+            t.tv_nsec -= 1000 * 1000 * 1000;
+        }
+        pthread_cond_timedwait(&workDone, &mutex, &t);
+    }
+
+    if (!failed) return;
+    failed = false;
+
+    if (interrupted) {
+        interrupted = false;
+        /* The worker left the flag set for us. */
+        _isInterrupted = 1;
+        checkInterrupt();
+        throw Interrupted("interrupted by the user");
+    }
+
+    if (sysError.get()) {
+        SysError e(*sysError);
+        sysError.reset();
+        throw e;
+    }
+
+    Error e(*error);
+    error.reset();
+    throw e;
+}
+
+
+bool ThreadPool::hasFailed()
+{
+    MutexLock lock(mutex);
+    return failed;
+}
+
+
+void * ThreadPool::workerEntry(void * arg)
+{
+    ((ThreadPool *) arg)->worker();
+    return 0;
+}
+
+
+void ThreadPool::worker()
+{
+    while (true) {
+
+        Work * work;
+
+        {
+            MutexLock lock(mutex);
+            while (queue.empty() && !quit)
+                pthread_cond_wait(&workAvailable, &mutex);
+            if (quit) return;
+            work = queue.front();
+            queue.pop_front();
+            active++;
+        }
+
+        bool ok = true, interrupted2 = false;
+        std::auto_ptr<SysError> sysError2;
+        std::auto_ptr<Error> error2;
+
+        try {
+            work->run();
+        } catch (Interrupted & e) {
+            ok = false;
+            interrupted2 = true;
+        } catch (SysError & e) {
+            ok = false;
+            sysError2.reset(new SysError(e));
+        } catch (Error & e) {
+            ok = false;
+            error2.reset(new Error(e));
+        } catch (BaseError & e) {
+            ok = false;
+            error2.reset(new Error(format("%1%") % e.msg(), e.status));
+        } catch (std::exception & e) {
+            ok = false;
+            error2.reset(new Error(format("%1%") % e.what()));
+        }
+
+        delete work;
+
+        {
+            MutexLock lock(mutex);
+            active--;
+            if (!ok && !failed) {
+                failed = true;
+                interrupted = interrupted2;
+                sysError = sysError2;
+                error = error2;
+                clearQueue();
+            }
+            pthread_cond_broadcast(&workDone);
+        }
+    }
+}
+
+
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include "types.hh"
+
+#include <memory>
+
+#include <pthread.h>
+
+
+namespace nix {
+
+
+/* Helper class to hold a mutex for the duration of a scope. */
+struct MutexLock
+{
+    pthread_mutex_t & mutex;
+    MutexLock(pthread_mutex_t & mutex) : mutex(mutex)
+    {
+        pthread_mutex_lock(&mutex);
+    }
+    ~MutexLock()
+    {
+        pthread_mutex_unlock(&mutex);
+    }
+};
+
+
+/* A fixed-size pool of worker threads that run queued work items.
+   Work items must not touch global state that isn't protected by a
+   lock.  In particular, they may only call printMsg() while holding
+   a lock that all of them share, and only if the main thread doesn't
+   log until process() has returned. */
+class ThreadPool
+{
+public:
+
+    struct Work
+    {
+        virtual ~Work() { }
+        virtual void run() = 0;
+    };
+
+    /* Start `nrThreads' worker threads.  0 means one per CPU core. */
+    ThreadPool(unsigned int nrThreads = 0);
+
+    /* Discard any work that hasn't started yet, and wait for the
+       work that has. */
+    ~ThreadPool();
+
+    /* Queue a work item.  The pool takes ownership of `work' and
+       deletes it after it has run. */
+    void enqueue(Work * work);
+
+    /* Wait until all queued work has finished.  If any work item
+       threw an exception, the remaining queued work is discarded and
+       the first error is rethrown here.  Interrupted and SysError
+       keep their type; other errors are rethrown as Error. */
+    void process();
+
+    /* Whether a work item has thrown an exception that process()
+       hasn't rethrown yet.  Callers that wait for results of their
+       own must stop waiting then, and call process(). */
+    bool hasFailed();
+
+    unsigned int size() const { return threads.size(); }
+
+private:
+
+    pthread_mutex_t mutex;
+    pthread_cond_t workAvailable, workDone;
+
+    std::list<Work *> queue;
+    unsigned int active;
+    bool quit;
+
+    /* The first error thrown by a work item. */
+    bool failed;
+    bool interrupted;
+    std::auto_ptr<SysError> sysError;
+    std::auto_ptr<Error> error;
+
+    vector<pthread_t> threads;
+
+    static void * workerEntry(void * arg);
+    void worker();
+    void clearQueue();
+};
+
+
+/* Return the number of online CPU cores, or 1 if unknown. */
+unsigned int getNrCores();
+
+
+}
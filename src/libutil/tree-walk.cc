@@ -0,0 +1,252 @@
+#include "config.h"
+
+#include "tree-walk.hh"
+#include "thread-pool.hh"
+#include "util.hh"
+
+#include <memory>
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+namespace nix {
+
+
+unsigned int walkThreads = 0;
+
+
+/* The number of directories that walkTree() reads on the calling
+   thread before it hands the rest of the tree to a thread pool.  Most
+   trees are small enough that starting threads isn't worth it. */
+static const unsigned int parallelThreshold = 256;
+
+
+/* A directory that is being walked.  It's finished when its entries
+   have been read and all its subdirectories are finished. */
+struct DirNode
+{
+    DirNode * parent;
+    /* The name of the directory relative to its parent, and its full
+       path (for the visitor and for error messages). */
+    string name;
+    Path path;
+    struct stat st;
+    unsigned int pending;
+    /* An open descriptor of the directory, kept while it has
+       subdirectories that haven't been finished yet, so that they
+       can be opened relative to it. */
+    int fd;
+};
+
+
+struct Walk
+{
+    TreeVisitor & visitor;
+
+    pthread_mutex_t mutex;
+
+    /* Directories still to be read if we're not using a pool. */
+    std::list<DirNode *> todo;
+    ThreadPool * pool;
+
+    std::list<DirNode *> nodes;
+
+    /* The first error, if any. */
+    bool failed;
+    std::auto_ptr<SysError> sysError;
+    std::auto_ptr<Error> error;
+
+    Walk(TreeVisitor & visitor) : visitor(visitor), pool(0), failed(false)
+    {
+        pthread_mutex_init(&mutex, 0);
+    }
+
+    ~Walk()
+    {
+        foreach (std::list<DirNode *>::iterator, i, nodes) {
+            if ((*i)->fd != -1) close((*i)->fd);
+            delete *i;
+        }
+        pthread_mutex_destroy(&mutex);
+    }
+
+    DirNode * addNode(DirNode * parent, const string & name,
+        const Path & path, const struct stat & st);
+    void schedule(DirNode * node);
+    void readDir(DirNode * node);
+    void release(DirNode * node);
+    void rethrow();
+};
+
+
+struct WalkWork : ThreadPool::Work
+{
+    Walk & walk;
+    DirNode * node;
+
+    WalkWork(Walk & walk, DirNode * node) : walk(walk), node(node) { }
+
+    void run()
+    {
+        /* Record the error ourselves rather than letting the pool do
+           it, so that the caller gets the original exception type
+           (in particular SysError). */
+        try {
+            {
+                MutexLock lock(walk.mutex);
+                if (walk.failed) return;
+            }
+            walk.readDir(node);
+        } catch (SysError & e) {
+            MutexLock lock(walk.mutex);
+            if (!walk.failed) walk.sysError.reset(new SysError(e));
+            walk.failed = true;
+        } catch (Error & e) {
+            MutexLock lock(walk.mutex);
+            if (!walk.failed) walk.error.reset(new Error(e));
+            walk.failed = true;
+        }
+    }
+};
+
+
+DirNode * Walk::addNode(DirNode * parent, const string & name,
+    const Path & path, const struct stat & st)
+{
+    DirNode * node = new DirNode;
+    node->parent = parent;
+    node->name = name;
+    node->path = path;
+    node->st = st;
+    node->pending = 1; /* released by readDir() */
+    node->fd = -1;
+    MutexLock lock(mutex);
+    nodes.push_back(node);
+    if (parent) parent->pending++;
+    return node;
+}
+
+
+void Walk::schedule(DirNode * node)
+{
+    {
+        MutexLock lock(mutex);
+        if (!pool) {
+            todo.push_back(node);
+            return;
+        }
+    }
+    pool->enqueue(new WalkWork(*this, node));
+}
+
+
+void Walk::readDir(DirNode * node)
+{
+    {
+        /* Open the directory relative to its parent, so that the
+           path isn't resolved again, and a directory that has been
+           replaced by a symlink in the meantime isn't followed. */
+        DirIterator dir(node->name, node->parent ? node->parent->fd : AT_FDCWD, O_NOFOLLOW);
+
+        /* Read all names first, since visitors may delete entries. */
+        Strings names;
+        while (dir.next()) names.push_back(dir.name());
+
+        int fd = dir.fd();
+
+        std::list<DirNode *> subdirs;
+
+        foreach (Strings::iterator, i, names) {
+            Path path = node->path + "/" + *i;
+            struct stat st;
+            if (fstatat(fd, i->c_str(), &st, AT_SYMLINK_NOFOLLOW) == -1)
+                throw SysError(format("getting attributes of path `%1%'") % path);
+            if (visitor.visit(fd, *i, path, st) && S_ISDIR(st.st_mode))
+                subdirs.push_back(addNode(node, *i, path, st));
+        }
+
+        if (!subdirs.empty()) {
+            node->fd = dup(fd);
+            if (node->fd == -1)
+                throw SysError(format("duplicating descriptor of `%1%'") % node->path);
+        }
+
+        foreach (std::list<DirNode *>::iterator, i, subdirs)
+            schedule(*i);
+    }
+
+    release(node);
+}
+
+
+void Walk::release(DirNode * node)
+{
+    while (node) {
+        {
+            MutexLock lock(mutex);
+            if (--node->pending) return;
+        }
+        if (node->fd != -1) {
+            close(node->fd);
+            node->fd = -1;
+        }
+        visitor.leave(node->path, node->st);
+        node = node->parent;
+    }
+}
+
+
+void Walk::rethrow()
+{
+    if (sysError.get()) throw SysError(*sysError);
+    if (error.get()) throw Error(*error);
+}
+
+
+void walkTree(const Path & path, TreeVisitor & visitor, unsigned int nrThreads)
+{
+    struct stat st;
+    if (lstat(path.c_str(), &st))
+        throw SysError(format("getting attributes of path `%1%'") % path);
+
+    if (!visitor.visit(AT_FDCWD, path, path, st) || !S_ISDIR(st.st_mode)) return;
+
+    if (nrThreads == 0) nrThreads = walkThreads;
+
+    Walk walk(visitor);
+
+    walk.readDir(walk.addNode(0, path, path, st));
+
+    /* Depth-first, to keep the number of pending directories low. */
+    unsigned int nrRead = 1;
+    while (!walk.todo.empty()) {
+
+        /* Only start threads if the tree turns out to be large. */
+        if (nrThreads != 1 && nrRead >= parallelThreshold) {
+            ThreadPool pool(nrThreads);
+            std::list<DirNode *> todo;
+            {
+                MutexLock lock(walk.mutex);
+                walk.pool = &pool;
+                todo.swap(walk.todo);
+            }
+            foreach (std::list<DirNode *>::iterator, i, todo)
+                pool.enqueue(new WalkWork(walk, *i));
+            pool.process();
+            walk.rethrow();
+            return;
+        }
+
+        checkInterrupt();
+        DirNode * node = walk.todo.back();
+        walk.todo.pop_back();
+        walk.readDir(node);
+        nrRead++;
+    }
+}
+
+
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "types.hh"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+
+namespace nix {
+
+
+/* Callbacks for walkTree().  They may be called from several threads
+   at the same time, so they must not call printMsg() or touch state
+   that isn't protected by a lock. */
+struct TreeVisitor
+{
+    virtual ~TreeVisitor() { }
+
+    /* Called for every entry of the tree, including the root.  `name'
+       is the name of the entry relative to the open directory
+       `dirFd' (for the root, `dirFd' is AT_FDCWD and `name' is the
+       full path), and `st' its lstat() information.  For a directory,
+       return true to walk its entries.  A directory is visited before
+       its entries. */
+    virtual bool visit(int dirFd, const string & name, const Path & path,
+        const struct stat & st) = 0;
+
+    /* Called for a directory after all its entries (and, recursively,
+       theirs) have been visited. */
+    virtual void leave(const Path & path, const struct stat & st) { }
+};
+
+
+/* Walk the directory tree rooted at `path'.  Each directory is opened
+   relative to its parent.  The entries of each directory are read and
+   visited by one thread.  Small trees are walked on the calling
+   thread; once a few hundred directories have been read, the
+   remaining subdirectories are queued so that idle threads pick them
+   up, unless `nrThreads' is 1.  0 means `walkThreads'.  The first
+   error stops the walk and is rethrown here. */
+void walkTree(const Path & path, TreeVisitor & visitor, unsigned int nrThreads = 0);
+
+/* Number of threads that walkTree() uses by default, and thus
+   deletePath(), computePathSize() and canonicalisePathMetaData().  0
+   means one per CPU core. */
+extern unsigned int walkThreads;
+
+
+}
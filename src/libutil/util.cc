@@ -14,6 +14,8 @@
 
 #include "util.hh"
 #include "immutable.hh"
+#include "tree-walk.hh"
+#include "thread-pool.hh"
 
 
 extern char * * environ;
@@ -193,19 +195,11 @@ bool isLink(const Path & path)
 Strings readDirectory(const Path & path)
 {
     Strings names;
-
-    AutoCloseDir dir = opendir(path.c_str());
-    if (!dir) throw SysError(format("opening directory `%1%'") % path);
-
-    struct dirent * dirent;
-    while (errno = 0, dirent = readdir(dir)) { /* sic */
+    DirIterator i(path);
+    while (i.next()) {
         checkInterrupt();
-        string name = dirent->d_name;
-        if (name == "." || name == "..") continue;
-        names.push_back(name);
+        names.push_back(i.name());
     }
-    if (errno) throw SysError(format("reading directory `%1%'") % path);
-
     return names;
 }
 
@@ -269,62 +263,82 @@ void writeLine(int fd, string s)
 }
 
 
-static void _computePathSize(const Path & path,
-    unsigned long long & bytes, unsigned long long & blocks)
+struct PathSizeVisitor : TreeVisitor
 {
-    checkInterrupt();
-
-    struct stat st = lstat(path);
-
-    bytes += st.st_size;
-    blocks += st.st_blocks;
+    pthread_mutex_t mutex;
+    unsigned long long bytes, blocks;
 
-    if (S_ISDIR(st.st_mode)) {
-	Strings names = readDirectory(path);
+    PathSizeVisitor() : bytes(0), blocks(0) { pthread_mutex_init(&mutex, 0); }
+    ~PathSizeVisitor() { pthread_mutex_destroy(&mutex); }
 
-	for (Strings::iterator i = names.begin(); i != names.end(); ++i)
-            _computePathSize(path + "/" + *i, bytes, blocks);
+    bool visit(int dirFd, const string & name, const Path & path, const struct stat & st)
+    {
+        MutexLock lock(mutex);
+        bytes += st.st_size;
+        blocks += st.st_blocks;
+        return true;
     }
-}
+};
 
 
 void computePathSize(const Path & path,
     unsigned long long & bytes, unsigned long long & blocks)
 {
-    bytes = 0;
-    blocks = 0;
-    _computePathSize(path, bytes, blocks);
+    PathSizeVisitor visitor;
+    walkTree(path, visitor);
+    bytes = visitor.bytes;
+    blocks = visitor.blocks;
 }
 
 
-static void _deletePath(const Path & path, unsigned long long & bytesFreed)
+/* Deletes a tree.  Directories are made writable when they're
+   visited, and removed once all their entries are gone. */
+struct DeleteVisitor : TreeVisitor
 {
-    checkInterrupt();
+    pthread_mutex_t mutex;
+    unsigned long long bytesFreed;
 
-    printMsg(lvlVomit, format("%1%") % path);
+    DeleteVisitor() : bytesFreed(0) { pthread_mutex_init(&mutex, 0); }
+    ~DeleteVisitor() { pthread_mutex_destroy(&mutex); }
 
-    struct stat st = lstat(path);
+    bool visit(int dirFd, const string & name, const Path & path, const struct stat & st)
+    {
+        if (S_ISDIR(st.st_mode) || S_ISREG(st.st_mode)) makeMutable(path);
 
-    if (S_ISDIR(st.st_mode) || S_ISREG(st.st_mode)) makeMutable(path);
+        if (S_ISDIR(st.st_mode)) {
+            if (!(st.st_mode & S_IWUSR)) {
+                if (chmod(path.c_str(), st.st_mode | S_IWUSR) == -1)
+                    throw SysError(format("making `%1%' writable") % path);
+            }
+            return true;
+        }
 
-    if (!S_ISDIR(st.st_mode) && st.st_nlink == 1)
-        bytesFreed += st.st_blocks * 512;
+        if (st.st_nlink == 1) {
+            MutexLock lock(mutex);
+            bytesFreed += st.st_blocks * 512;
+        }
 
-    if (S_ISDIR(st.st_mode)) {
-	Strings names = readDirectory(path);
+        if (unlinkat(dirFd, name.c_str(), 0) == -1)
+            throw SysError(format("cannot unlink `%1%'") % path);
 
-	/* Make the directory writable. */
-	if (!(st.st_mode & S_IWUSR)) {
-	    if (chmod(path.c_str(), st.st_mode | S_IWUSR) == -1)
-		throw SysError(format("making `%1%' writable") % path);
-	}
+        return false;
+    }
 
-	for (Strings::iterator i = names.begin(); i != names.end(); ++i)
-            _deletePath(path + "/" + *i, bytesFreed);
+    void leave(const Path & path, const struct stat & st)
+    {
+        if (rmdir(path.c_str()) == -1)
+            throw SysError(format("cannot unlink `%1%'") % path);
     }
+};
 
-    if (remove(path.c_str()) == -1)
-        throw SysError(format("cannot unlink `%1%'") % path);
+
+static void _deletePath(const Path & path, unsigned long long & bytesFreed, bool quiet)
+{
+    /* The quiet variant is meant to be called from ThreadPool work
+       items, so don't start another pool from there. */
+    DeleteVisitor visitor;
+    walkTree(path, visitor, quiet ? 1 : 0);
+    bytesFreed = visitor.bytesFreed;
 }
 
 
@@ -340,7 +354,14 @@ void deletePath(const Path & path, unsigned long long & bytesFreed)
     startNest(nest, lvlDebug,
         format("recursively deleting path `%1%'") % path);
     bytesFreed = 0;
-    _deletePath(path, bytesFreed);
+    _deletePath(path, bytesFreed, false);
+}
+
+
+void deletePathQuiet(const Path & path, unsigned long long & bytesFreed)
+{
+    bytesFreed = 0;
+    _deletePath(path, bytesFreed, true);
 }
 
 
@@ -736,6 +757,59 @@ void AutoCloseDir::close()
 //////////////////////////////////////////////////////////////////////
 
 
+DirIterator::DirIterator(const Path & path, int dirFd, int flags)
+    : path(path), dirent(0)
+{
+    int fd = openat(dirFd, path.c_str(), O_RDONLY | O_DIRECTORY | flags);
+    if (fd == -1) throw SysError(format("opening directory `%1%'") % path);
+    dir = fdopendir(fd);
+    if (!dir) {
+        int errNo = errno;
+        ::close(fd);
+        errno = errNo;
+        throw SysError(format("opening directory `%1%'") % path);
+    }
+}
+
+
+DirIterator::~DirIterator()
+{
+    closedir(dir);
+}
+
+
+bool DirIterator::next()
+{
+    while (errno = 0, dirent = readdir(dir)) { /* sic */
+        const char * s = dirent->d_name;
+        if (s[0] == '.' && (s[1] == 0 || (s[1] == '.' && s[2] == 0))) continue;
+        return true;
+    }
+    if (errno) throw SysError(format("reading directory `%1%'") % path);
+    return false;
+}
+
+
+struct stat DirIterator::lstat() const
+{
+    struct stat st;
+    if (fstatat(dirfd(dir), dirent->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+        throw SysError(format("getting attributes of path `%1%/%2%'") % path % dirent->d_name);
+    return st;
+}
+
+
+int DirIterator::open(int flags) const
+{
+    int fd = openat(dirfd(dir), dirent->d_name, flags);
+    if (fd == -1) throw SysError(format("opening file `%1%/%2%'") % path % dirent->d_name);
+    return fd;
+}
+
+
+//////////////////////////////////////////////////////////////////////
+
+
 Pid::Pid()
 {
     pid = -1;
@@ -973,13 +1047,19 @@ pid_t (*maybeVfork)() = fork;
 
 volatile sig_atomic_t _isInterrupted = 0;
 
+/* Static initialisation happens on the main thread. */
+static pthread_t mainThread = pthread_self();
+
 void _interrupted()
 {
     /* Block user interrupts while an exception is being handled.
        Throwing an exception while another exception is being handled
        kills the program! */
     if (!std::uncaught_exception()) {
-        _isInterrupted = 0;
+        /* Worker threads abandon their work, but leave the flag set
+           so that the main thread gets to handle the interrupt. */
+        if (pthread_equal(pthread_self(), mainThread))
+            _isInterrupted = 0;
         throw Interrupted("interrupted by the user");
     }
 }
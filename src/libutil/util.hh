@@ -7,6 +7,7 @@
 #include <dirent.h>
 #include <unistd.h>
 #include <signal.h>
+#include <fcntl.h>
 
 #include <cstdio>
 
@@ -85,6 +86,10 @@ void deletePath(const Path & path);
 
 void deletePath(const Path & path, unsigned long long & bytesFreed);
 
+/* Like deletePath(), but doesn't log anything, so that it can be
+   called from a ThreadPool work item. */
+void deletePathQuiet(const Path & path, unsigned long long & bytesFreed);
+
 /* Make a path read-only recursively. */
 void makePathReadOnly(const Path & path);
 
@@ -230,6 +235,52 @@ public:
 };
 
 
+/* Iterate over the entries of a directory (except `.' and `..')
+   through one open descriptor, so that they can be examined and
+   opened relative to it rather than by full path.  Unlike
+   readDirectory(), this doesn't copy the names, and it reports the
+   type of each entry where the file system provides it, which often
+   saves an lstat(). */
+class DirIterator
+{
+    Path path;
+    DIR * dir;
+    struct dirent * dirent;
+    DirIterator(const DirIterator &);
+    DirIterator & operator =(const DirIterator &);
+public:
+    /* Open the directory `path'.  A relative `path' is looked up
+       relative to the open directory `dirFd'.  `flags' are passed to
+       openat(); callers that have lstat()ed the entry already pass
+       O_NOFOLLOW so that it can't be replaced by a symlink in the
+       meantime.  Otherwise a symlink to a directory is followed, like
+       opendir() does. */
+    DirIterator(const Path & path, int dirFd = AT_FDCWD, int flags = 0);
+    ~DirIterator();
+
+    /* Advance to the next entry.  Returns false at the end. */
+    bool next();
+
+    /* The name of the current entry.  Valid until the next call to
+       next(). */
+    const char * name() const { return dirent->d_name; }
+
+    /* The type of the current entry (DT_DIR, DT_REG, DT_LNK, ...), or
+       DT_UNKNOWN if the file system doesn't tell. */
+    unsigned char type() const { return dirent->d_type; }
+
+    /* lstat() the current entry. */
+    struct stat lstat() const;
+
+    /* Open the current entry. */
+    int open(int flags) const;
+
+    /* The descriptor of the directory, for use with the *at()
+       functions. */
+    int fd() const { return dirfd(dir); }
+};
+
+
 class Pid
 {
     pid_t pid;
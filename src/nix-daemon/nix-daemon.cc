@@ -232,49 +232,8 @@ struct TunnelSource : BufferedSource
 };
 
 
-/* If the NAR archive contains a single file at top-level, then save
-   the contents of the file to `s'.  Otherwise barf. */
-struct RetrieveRegularNARSink : ParseSink
-{
-    bool regular;
-    string s;
-
-    RetrieveRegularNARSink() : regular(true) { }
-
-    void createDirectory(const Path & path)
-    {
-        regular = false;
-    }
-
-    void receiveContents(unsigned char * data, unsigned int len)
-    {
-        s.append((const char *) data, len);
-    }
-
-    void createSymlink(const Path & path, const string & target)
-    {
-        regular = false;
-    }
-};
-
-
-/* Adapter class of a Source that saves all data read to `s'. */
-struct SavingSourceAdapter : Source
-{
-    Source & orig;
-    string s;
-    SavingSourceAdapter(Source & orig) : orig(orig) { }
-    size_t read(unsigned char * data, size_t len)
-    {
-        size_t n = orig.read(data, len);
-        s.append((const char *) data, n);
-        return n;
-    }
-};
-
-
 static void performOp(unsigned int clientVersion,
-    Source & from, Sink & to, unsigned int op)
+    Source & from, FdSink & to, unsigned int op)
 {
     switch (op) {
 
@@ -305,6 +264,34 @@ static void performOp(unsigned int clientVersion,
         break;
     }
 
+    case wopQueryClosure: {
+        PathSet paths = readStorePaths<PathSet>(from);
+        bool flipDirection = readInt(from) == 1;
+        bool includeOutputs = readInt(from) == 1;
+        startWork();
+        PathSet closure;
+        store->queryClosure(paths, closure, flipDirection, includeOutputs);
+        stopWork();
+        writeStrings(closure, to);
+        break;
+    }
+
+    case wopQueryBuildTimes: {
+        PathSet drvPaths = readStorePaths<PathSet>(from);
+        startWork();
+        BuildTimes times;
+        store->queryBuildTimes(drvPaths, times);
+        stopWork();
+        writeInt(times.size(), to);
+        foreach (BuildTimes::iterator, i, times) {
+            writeString(i->first, to);
+            writeLongLong(i->second.duration, to);
+            writeLongLong(i->second.outputSize, to);
+            writeInt(i->second.buildCores, to);
+        }
+        break;
+    }
+
     case wopHasSubstitutes: {
         Path path = readStorePath(from);
         startWork();
@@ -388,22 +375,68 @@ static void performOp(unsigned int clientVersion,
         }
         HashType hashAlgo = parseHashType(s);
 
-        SavingSourceAdapter savedNAR(from);
-        RetrieveRegularNARSink savedRegular;
+        /* Unpack the NAR into a temporary directory in the store
+           while receiving it from the client, rather than buffering
+           it in memory.  Since this reads from the client, we can't
+           tunnel stderr yet, so only do the rest afterwards. */
+        LocalStore * localStore = dynamic_cast<LocalStore *>(store.get());
+        Path tmpDir = localStore->createTempDirInStore();
+        AutoDelete delTmp(tmpDir);
+        Path tmpPath = tmpDir + "/x";
+        HashResult narHash;
+        FileHashSink fileHashes(settings.autoOptimiseStore);
+        Path path = localStore->unpackDump(from, tmpPath, baseName, recursive, hashAlgo,
+            narHash, fileHashes);
 
-        if (recursive) {
-            /* Get the entire NAR dump from the client and save it to
-               a string so that we can pass it to
-               addToStoreFromDump(). */
-            ParseSink sink; /* null sink; just parse the NAR */
-            parseDump(sink, savedNAR);
-        } else
-            parseDump(savedRegular, from);
+        startWork();
+        if (path == "") throw Error("regular file expected");
+        localStore->addTempPathToStore(tmpPath, path, narHash, false, &fileHashes);
+        stopWork();
+
+        writeString(path, to);
+        break;
+    }
+
+    case wopAddToStoreNar: {
+        string baseName = readString(from);
+        bool recursive = readInt(from) == 1;
+        string hashAlgoName = readString(from);
+        string expectedHash = readString(from);
+
+        /* If the client told us the hash of the contents, we can
+           check whether the resulting path is already valid and tell
+           the client to skip the upload. */
+        startWork();
+        HashType hashAlgo = parseHashType(hashAlgoName);
+        if (hashAlgo == htUnknown)
+            throw Error(format("unknown hash type `%1%'") % hashAlgoName);
+        Path path;
+        if (expectedHash != "") {
+            path = makeFixedOutputPath(recursive, hashAlgo,
+                parseHash(hashAlgo, expectedHash), baseName);
+            store->addTempRoot(path);
+            if (!store->isValidPath(path)) path = "";
+        }
+        stopWork();
+        writeString(path, to);
+        if (path != "") break;
+
+        /* The client now sends the NAR.  Unpack it into a temporary
+           directory while receiving it, and add it to the store once
+           we can report errors to the client again. */
+        to.flush();
+        LocalStore * localStore = dynamic_cast<LocalStore *>(store.get());
+        Path tmpDir = localStore->createTempDirInStore();
+        AutoDelete delTmp(tmpDir);
+        Path tmpPath = tmpDir + "/x";
+        HashResult narHash;
+        FileHashSink fileHashes(settings.autoOptimiseStore);
+        path = localStore->unpackDump(from, tmpPath, baseName, recursive, hashAlgo,
+            narHash, fileHashes);
 
         startWork();
-        if (!savedRegular.regular) throw Error("regular file expected");
-        Path path = dynamic_cast<LocalStore *>(store.get())
-            ->addToStoreFromDump(recursive ? savedNAR.s : savedRegular.s, baseName, recursive, hashAlgo);
+        if (path == "") throw Error("regular file expected");
+        localStore->addTempPathToStore(tmpPath, path, narHash, false, &fileHashes);
         stopWork();
 
         writeString(path, to);
@@ -503,18 +536,26 @@ static void performOp(unsigned int clientVersion,
         options.pathsToDelete = readStorePaths<PathSet>(from);
         options.ignoreLiveness = readInt(from);
         options.maxFreed = readLongLong(from);
+        unsigned int order = options.order;
         readInt(from); // obsolete field
         if (GET_PROTOCOL_MINOR(clientVersion) >= 5) {
             /* removed options */
             readInt(from);
             readInt(from);
         }
+        if (GET_PROTOCOL_MINOR(clientVersion) >= 15) {
+            options.minFree = readLongLong(from);
+            order = readInt(from);
+        }
 
         GCResults results;
 
         startWork();
         if (options.ignoreLiveness)
             throw Error("you are not allowed to ignore liveness");
+        if (order > GCOptions::gcOrderAtime)
+            throw Error("invalid GC order");
+        options.order = (GCOptions::GCOrder) order;
         store->collectGarbage(options, results);
         stopWork();
 
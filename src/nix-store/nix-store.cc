@@ -314,16 +314,17 @@ static void opQuery(Strings opFlags, Strings opArgs)
         case qReferences:
         case qReferrers:
         case qReferrersClosure: {
-            PathSet paths;
+            PathSet args, paths;
             foreach (Strings::iterator, i, opArgs) {
                 PathSet ps = maybeUseOutputs(followLinksToStorePath(*i), useOutput, forceRealise);
-                foreach (PathSet::iterator, j, ps) {
-                    if (query == qRequisites) computeFSClosure(*store, *j, paths, false, includeOutputs);
-                    else if (query == qReferences) store->queryReferences(*j, paths);
-                    else if (query == qReferrers) store->queryReferrers(*j, paths);
-                    else if (query == qReferrersClosure) computeFSClosure(*store, *j, paths, true);
-                }
+                args.insert(ps.begin(), ps.end());
             }
+            if (query == qRequisites) store->queryClosure(args, paths, false, includeOutputs);
+            else if (query == qReferrersClosure) store->queryClosure(args, paths, true);
+            else
+                foreach (PathSet::iterator, j, args)
+                    if (query == qReferences) store->queryReferences(*j, paths);
+                    else store->queryReferrers(*j, paths);
             Paths sorted = topoSortPaths(*store, paths);
             for (Paths::reverse_iterator i = sorted.rbegin();
                  i != sorted.rend(); ++i)
@@ -400,12 +401,12 @@ static void opQuery(Strings opFlags, Strings opArgs)
         }
 
         case qRoots: {
-            PathSet referrers;
+            PathSet args, referrers;
             foreach (Strings::iterator, i, opArgs) {
                 PathSet paths = maybeUseOutputs(followLinksToStorePath(*i), useOutput, forceRealise);
-                foreach (PathSet::iterator, j, paths)
-                    computeFSClosure(*store, *j, referrers, true);
+                args.insert(paths.begin(), paths.end());
             }
+            computeFSClosure(*store, args, referrers, true);
             Roots roots = store->findRoots();
             foreach (Roots::iterator, i, roots)
                 if (referrers.find(i->second) != referrers.end())
@@ -616,6 +617,18 @@ static void opGC(Strings opFlags, Strings opArgs)
             long long maxFreed = getIntArg<long long>(*i, i, opFlags.end());
             options.maxFreed = maxFreed >= 0 ? maxFreed : 0;
         }
+        else if (*i == "--min-free") {
+            long long minFree = getIntArg<long long>(*i, i, opFlags.end());
+            options.minFree = minFree >= 0 ? minFree : 0;
+        }
+        else if (*i == "--order") {
+            if (++i == opFlags.end()) throw UsageError("`--order' requires an argument");
+            if (*i == "random") options.order = GCOptions::gcOrderRandom;
+            else if (*i == "oldest") options.order = GCOptions::gcOrderOldest;
+            else if (*i == "largest") options.order = GCOptions::gcOrderLargest;
+            else if (*i == "atime") options.order = GCOptions::gcOrderAtime;
+            else throw UsageError(format("unknown GC order `%1%'") % *i);
+        }
         else throw UsageError(format("bad sub-operation `%1%' in GC") % *i);
 
     if (!opArgs.empty()) throw UsageError("no arguments expected");
@@ -732,14 +745,17 @@ static void opVerify(Strings opFlags, Strings opArgs)
 
     bool checkContents = false;
     bool repair = false;
+    unsigned int maxPaths = 0, maxTime = 0;
 
     for (Strings::iterator i = opFlags.begin();
          i != opFlags.end(); ++i)
         if (*i == "--check-contents") checkContents = true;
         else if (*i == "--repair") repair = true;
+        else if (*i == "--max-paths") maxPaths = getIntArg<unsigned int>(*i, i, opFlags.end());
+        else if (*i == "--max-time") maxTime = getIntArg<unsigned int>(*i, i, opFlags.end());
         else throw UsageError(format("unknown flag `%1%'") % *i);
 
-    if (ensureLocalStore().verifyStore(checkContents, repair)) {
+    if (ensureLocalStore().verifyStore(checkContents, repair, maxPaths, maxTime)) {
         printMsg(lvlError, "warning: not all errors were fixed");
         exitCode = 1;
     }
@@ -789,6 +805,21 @@ static void showOptimiseStats(OptimiseStats & stats)
         % stats.filesLinked
         % stats.sameContents
         % stats.totalFiles);
+    if (stats.filesShared)
+        printMsg(lvlError,
+            format("%1% shared by the file system between %2% files and their duplicates")
+            % showBytes(stats.bytesShared)
+            % stats.filesShared);
+    if (stats.pathsSkipped)
+        printMsg(lvlError,
+            format("skipped %1% paths that were optimised before") % stats.pathsSkipped);
+    if (stats.filesHashed)
+        printMsg(lvlError,
+            format("hashed %1% files (%2%) in %3$.1f seconds (%4$.1f MiB/s)")
+            % stats.filesHashed
+            % showBytes(stats.bytesHashed)
+            % stats.seconds
+            % (stats.seconds ? stats.bytesHashed / (1024.0 * 1024.0) / stats.seconds : 0));
 }
 
 
@@ -898,7 +929,9 @@ void run(Strings args)
             indirectRoot = true;
         else if (arg[0] == '-') {
             opFlags.push_back(arg);
-            if (arg == "--max-freed" || arg == "--max-links" || arg == "--max-atime") { /* !!! hack */
+            if (arg == "--max-freed" || arg == "--max-links" || arg == "--max-atime" ||
+                arg == "--min-free" || arg == "--order" ||
+                arg == "--max-paths" || arg == "--max-time") { /* !!! hack */
                 if (i != args.end()) opFlags.push_back(*i++);
             }
         }
@@ -26,3 +26,24 @@ hash2=$(nix-hash --type sha256 --base32 ./dummy)
 echo $hash2
 
 test "$hash1" = "sha256:$hash2"
+
+# Adding a directory tree must give the same contents and NAR hash
+# as the original.
+rm -rf $TEST_ROOT/tree
+mkdir -p $TEST_ROOT/tree/sub
+echo foo > $TEST_ROOT/tree/foo
+echo bar > $TEST_ROOT/tree/sub/bar
+chmod +x $TEST_ROOT/tree/sub/bar
+ln -s foo $TEST_ROOT/tree/link
+
+path5=$(nix-store --add $TEST_ROOT/tree)
+echo $path5
+diff -r $TEST_ROOT/tree $path5
+test -x $path5/sub/bar
+
+hash5=$(nix-store -q --hash $path5)
+test "$hash5" = "sha256:$(nix-hash --type sha256 --base32 $TEST_ROOT/tree)"
+
+path6=$(nix-store --add-fixed sha1 --recursive $TEST_ROOT/tree)
+echo $path6
+test "$path6" = "$(nix-store --print-fixed-path --recursive sha1 $(nix-hash --type sha1 $TEST_ROOT/tree) tree)"
@@ -11,6 +11,10 @@ outPath=$(nix-build dependencies.nix --no-out-link)
 
 nix-push --dest $cacheDir $outPath
 
+cacheDir2=$TEST_ROOT/binary-cache-2
+rm -rf $cacheDir2
+nix-push --bzip2 --dest $cacheDir2 $outPath
+
 
 # By default, a binary cache doesn't support "nix-env -qas", but does
 # support installation.
@@ -37,3 +41,37 @@ nix-store --option binary-caches "file://$cacheDir" -r $outPath
 nix-store --check-validity $outPath
 nix-store -qR $outPath | grep input-2
 
+
+# Local binary caches are read by the builtin substituter, which also
+# handles bzip2-compressed NARs.
+clearStore
+rm -f $NIX_STATE_DIR/binary-cache*
+
+NIX_SUBSTITUTERS=builtin-binary-cache nix-store --option binary-caches "file://$cacheDir2" -r $outPath
+
+nix-store --check-validity $outPath
+nix-store -qR $outPath | grep input-2
+
+
+# The builtin substituter tries local caches in order of priority.
+clearStore
+rm -f $NIX_STATE_DIR/binary-cache*
+echo "Priority: 60" >> $cacheDir/nix-cache-info
+echo "Priority: 40" >> $cacheDir2/nix-cache-info
+
+nix-store --option binary-caches "file://$cacheDir file://$cacheDir2" -r $outPath 2> $TEST_ROOT/log
+grep -q "unpacking \`$cacheDir2/" $TEST_ROOT/log
+(! grep -q "unpacking \`$cacheDir/" $TEST_ROOT/log)
+
+
+# If there are other caches as well, it can't know their priorities,
+# so download-from-binary-cache.pl handles all caches.
+clearStore
+rm -f $NIX_STATE_DIR/binary-cache*
+
+nix-store --option binary-caches "file://$cacheDir2 http://127.0.0.1:1" -r $outPath 2> $TEST_ROOT/log
+grep -q "Downloading" $TEST_ROOT/log
+(! grep -q "unpacking" $TEST_ROOT/log)
+
+nix-store --check-validity $outPath
+nix-store -qR $outPath | grep input-2
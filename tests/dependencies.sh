@@ -47,6 +47,24 @@ input2OutPath=$(echo "$deps" | grep "dependencies-input-2")
 # The referrers closure of input-2 should include outPath.
 nix-store -q --referrers-closure "$input2OutPath" | grep "$outPath"
 
+# With --include-outputs, the closure of the derivation contains the
+# closure of its output.
+closure=$(nix-store -qR --include-outputs "$drvPath")
+for i in $(nix-store -qR "$outPath"); do
+    echo "$closure" | grep -q "$i"
+done
+
 # Check that the derivers are set properly.
 test $(nix-store -q --deriver "$outPath") = "$drvPath"
 nix-store -q --deriver "$input2OutPath" | grep -q -- "-input-2.drv" 
+
+# The path info cache shouldn't change query results, even when it's
+# too small to hold the closure.
+for size in 2 1000; do
+    test "$(nix-store --option path-info-cache-size $size -qR "$drvPath")" = "$(nix-store -qR "$drvPath")"
+    test "$(nix-store --option path-info-cache-size $size -q --tree "$outPath")" = "$(nix-store -q --tree "$outPath")"
+done
+
+# The referrers closure of an invalid path is the path itself.
+invalid=$NIX_STORE_DIR/00000000000000000000000000000000-invalid
+test "$(nix-store -q --referrers-closure "$invalid")" = "$invalid"
@@ -16,11 +16,21 @@ if nix-store --import < $TEST_ROOT/exp; then
     exit 1
 fi
 
+# Nothing should have been registered by the failed import.
+if nix-store --check-validity $outPath 2> /dev/null; then
+    echo "failed import registered a path"
+    exit 1
+fi
+
 
 clearStore
 
 nix-store --import < $TEST_ROOT/exp_all
 
+# All paths of the closure are registered with their references.
+nix-store --check-validity $(nix-store -qR $outPath)
+test "$(nix-store -qR $outPath | wc -l)" -ge 2
+
 nix-store --export $(nix-store -qR $outPath) > $TEST_ROOT/exp_all2
 
 
@@ -29,3 +39,26 @@ clearStore
 # Regression test: the derivers in exp_all2 are empty, which shouldn't
 # cause a failure.
 nix-store --import < $TEST_ROOT/exp_all2
+
+
+# Test restoring a tree with many small files, an executable, a
+# symlink and a file large enough to bypass the worker threads.
+tree=$TEST_ROOT/tree
+rm -rf $tree $TEST_ROOT/restored*
+mkdir -p $tree/sub
+for i in $(seq 1 200); do echo "file $i" > $tree/sub/$i; done
+touch $tree/empty
+echo "#! /bin/sh" > $tree/script
+chmod +x $tree/script
+ln -s sub/1 $tree/link
+dd if=/dev/urandom of=$tree/large bs=1024 count=2048 2> /dev/null
+
+nix-store --dump $tree > $TEST_ROOT/tree.nar
+
+nix-store --restore $TEST_ROOT/restored < $TEST_ROOT/tree.nar
+diff -r $tree $TEST_ROOT/restored
+test -x $TEST_ROOT/restored/script
+test "$(readlink $TEST_ROOT/restored/link)" = sub/1
+
+nix-store --option restore-threads 1 --restore $TEST_ROOT/restored1 < $TEST_ROOT/tree.nar
+diff -r $tree $TEST_ROOT/restored1
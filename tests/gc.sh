@@ -14,6 +14,10 @@ if nix-store --gc --print-dead | grep $outPath; then false; fi
 
 nix-store --gc --print-dead
 
+# With gc-keep-derivations, a live output keeps its deriver alive.
+nix-store --gc --print-live --option gc-keep-derivations true | grep $drvPath
+if nix-store --gc --print-dead --option gc-keep-derivations true | grep $drvPath; then false; fi
+
 inUse=$(readLink $outPath/input-2)
 if nix-store --delete $inUse; then false; fi
 test -e $inUse
@@ -32,6 +36,13 @@ if test -e $drvPath; then false; fi
 
 rm "$NIX_STATE_DIR"/gcroots/foo
 
+# Nothing needs to be deleted to have 1 byte available.
+nix-store --gc --min-free 1 --order largest
+test -e $outPath/foobar
+
+# Delete the output on more than one thread.
+nix-store --gc --option gc-delete-threads 2
+
 nix-collect-garbage
 
 # Check that the output has been GC'd.
@@ -24,3 +24,55 @@ if [ -n "$(ls $NIX_STORE_DIR/.links)" ]; then
     echo ".links directory not empty after GC"
     exit 1
 fi
+
+# The per-file hashes computed while scanning for references must be
+# the same as those computed by hashPath(), so that executables and
+# plain files with the same contents are not merged.
+outPath3=$(echo 'with import ./config.nix; mkDerivation { name = "foo3"; builder = builtins.toFile "builder" "mkdir $out; echo hello > $out/foo; echo hello > $out/bar; chmod +x $out/bar; ln -s foo $out/baz"; }' | nix-build - --no-out-link --option auto-optimise-store true)
+
+if [ "$(perl -e "print ((lstat('$outPath3/foo'))[1])")" = "$(perl -e "print ((lstat('$outPath3/bar'))[1])")" ]; then
+    echo "executable and non-executable files were merged"
+    exit 1
+fi
+
+for i in $NIX_STORE_DIR/.links/*; do
+    if [ "$(basename $i)" != "$(nix-hash --type sha256 --base32 $i)" ]; then
+        echo "link $i has the wrong name"
+        exit 1
+    fi
+done
+
+# Test `nix-store --optimise' with several hashing threads.  The second
+# run should find everything already linked.
+outPath4=$(echo 'with import ./config.nix; mkDerivation { name = "foo4"; builder = builtins.toFile "builder" "mkdir $out; echo world > $out/foo"; }' | nix-build - --no-out-link)
+outPath5=$(echo 'with import ./config.nix; mkDerivation { name = "foo5"; builder = builtins.toFile "builder" "mkdir $out; echo world > $out/foo"; }' | nix-build - --no-out-link)
+# A path that is a single file is replaced by a link as a whole.
+outPath7=$(echo 'with import ./config.nix; mkDerivation { name = "foo7"; builder = builtins.toFile "builder" "echo world > $out"; }' | nix-build - --no-out-link)
+
+nix-store --optimise --option optimise-threads 2
+
+inode4="$(perl -e "print ((lstat('$outPath4/foo'))[1])")"
+inode5="$(perl -e "print ((lstat('$outPath5/foo'))[1])")"
+if [ "$inode4" != "$inode5" ]; then
+    echo "inodes do not match after optimise"
+    exit 1
+fi
+
+nix-store --optimise 2>&1 | tee $TEST_ROOT/optimise.log
+grep -q "0.00 MiB freed by hard-linking 0 files" $TEST_ROOT/optimise.log
+
+# The paths optimised by the previous run should have been skipped
+# without hashing anything.
+grep -q "skipped .* paths that were optimised before" $TEST_ROOT/optimise.log
+if grep -q "^hashed" $TEST_ROOT/optimise.log; then
+    echo "files of already optimised paths were hashed again"
+    exit 1
+fi
+
+# Whether `optimise-method = reflink' works depends on the file system
+# holding the test store, so only check that bad values are rejected.
+outPath6=$(echo 'with import ./config.nix; mkDerivation { name = "foo6"; builder = builtins.toFile "builder" "mkdir $out; echo world > $out/foo"; }' | nix-build - --no-out-link)
+if nix-store --optimise --option optimise-method foo; then
+    echo "invalid optimise-method was accepted"
+    exit 1
+fi
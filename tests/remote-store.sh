@@ -4,4 +4,19 @@ clearStore
 clearManifests
 startDaemon
 $SHELL ./user-envs.sh
+
+# Adding a path through the daemon must give the same result as adding
+# it locally, whether or not it is already valid.
+path1=$(nix-store --add ./dummy)
+path2=$(nix-store --add ./dummy)
+test "$path1" = "$path2"
+test "$path1" = "$(NIX_REMOTE= nix-store --add ./dummy)"
+path3=$(nix-store --add-fixed sha1 ./dummy)
+test "$(cat $path3)" = "$(cat ./dummy)"
+
+# Closures computed by the daemon must match the local ones.
+drvs=$(ls -d $NIX_STORE_DIR/*.drv)
+test "$(nix-store -qR --include-outputs $drvs)" = "$(NIX_REMOTE= nix-store -qR --include-outputs $drvs)"
+test "$(nix-store -q --referrers-closure $path1)" = "$(NIX_REMOTE= nix-store -q --referrers-closure $path1)"
+
 killDaemon
@@ -18,6 +18,9 @@ if test "$text" != "Hello World!"; then exit 1; fi
 nix-store --delete $outPath
 if test -e $outPath/hello; then false; fi
 
+# The build has been recorded, so rebuilding it comes with an estimate.
+nix-store -r --dry-run "$drvPath" 2>&1 | grep -q "going by earlier builds of 1 of 1"
+
 outPath="$(NIX_STORE_DIR=/foo nix-instantiate --readonly-mode hash-check.nix)"
 if test "$outPath" != "/foo/lfy1s6ca46rm5r6w4gg9hc0axiakjcnm-dependencies.drv"; then
     echo "hashDerivationModulo appears broken, got $outPath"
@@ -20,3 +20,11 @@ nix-store -rvv "$drvPath"
 
 text=$(cat "$outPath"/hello)
 if test "$text" != "Hallo Wereld"; then echo "wrong substitute output: $text"; exit 1; fi
+
+# Substitutions with their own slots don't need a build slot.
+clearStore
+drvPath=$(nix-instantiate simple.nix)
+nix-store -rvv "$drvPath" -j0 --option build-max-substitution-jobs 1
+
+text=$(cat "$outPath"/hello)
+if test "$text" != "Hallo Wereld"; then echo "wrong substitute output: $text"; exit 1; fi
@@ -1,3 +1,54 @@
 source common.sh
 
+clearStore
+
+outPath=$(nix-build dependencies.nix --no-out-link)
+
 nix-store --verify
+
+nix-store --verify --check-contents --option verify-threads 2 --option verify-max-rate 100000000
+
+# A full check verifies every path.  Verification times have a
+# resolution of one second, hence the sleeps below.
+nrPaths=$(nix-store -v --verify --check-contents 2>&1 | grep -c "^checked \`")
+[ "$nrPaths" -gt 3 ]
+sleep 1
+
+# Incremental checks start with the least recently verified paths, so
+# consecutive runs check different paths.
+checked() {
+    nix-store -v --verify --check-contents "$@" 2>&1 | sed -n "s/^checked \`\(.*\)'$/\1/p"
+}
+p1=$(checked --max-paths 1)
+sleep 1
+p2=$(checked --max-paths 1)
+sleep 1
+p3=$(checked --max-paths 1)
+[ -n "$p1" -a -n "$p2" -a -n "$p3" ]
+[ "$p1" != "$p2" -a "$p2" != "$p3" -a "$p1" != "$p3" ]
+
+# The paths just checked come last.
+sleep 1
+rest=$(checked --max-paths $((nrPaths - 3)))
+[ "$(echo "$rest" | wc -l)" -eq $((nrPaths - 3)) ]
+(! echo "$rest" | grep -qx "$p1\|$p2\|$p3")
+
+nix-store --verify --check-contents --max-time 60
+
+# A corrupted path is found within one round of incremental checks.
+chmod -R u+w $outPath
+echo corrupt >> $outPath/foobar
+found=
+for i in $(seq 1 $nrPaths); do
+    sleep 1
+    if ! nix-store --verify --check-contents --max-paths 1 2> $TEST_ROOT/log; then
+        grep -q "path \`$outPath' was modified" $TEST_ROOT/log
+        found=1
+        break
+    fi
+done
+[ -n "$found" ]
+
+# Nothing else is wrong.
+sed -i '$d' $outPath/foobar
+nix-store --verify --check-contents